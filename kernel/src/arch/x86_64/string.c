@@ -0,0 +1,60 @@
+#include "string.h"
+#include "global.h"
+#include "kprint.h"
+#include "cpu/cpu.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * With ERMS, rep movsb/stosb beat any loop once a copy is past their
+ * startup cost; FSRM makes them fast for short copies as well. Until
+ * string_init() runs, everything goes through the word loops.
+ */
+#define CPUID7_EBX_ERMS (1u << 9)
+#define CPUID7_EDX_FSRM (1u << 4)
+
+/* Below this, rep without FSRM loses to the word loop */
+#define REP_MIN_SIZE 64
+
+static bool rep_fast;
+static bool rep_fast_short;
+
+void string_init(void) {
+    if (cpuid_max(0) < 7) return;
+
+    uint32_t a, b, c, d;
+    cpuid(7, 0, &a, &b, &c, &d);
+    rep_fast = b & CPUID7_EBX_ERMS;
+    rep_fast_short = rep_fast && (d & CPUID7_EDX_FSRM);
+
+    if (debug) kprint(LOG_DEBUG, "STRING: %s\n",
+                      rep_fast_short ? "rep movsb/stosb (ERMS, FSRM)" :
+                      rep_fast ? "rep movsb/stosb (ERMS)" : "word loops");
+}
+
+static inline bool use_rep(size_t n) {
+    return rep_fast_short || (rep_fast && n >= REP_MIN_SIZE);
+}
+
+void *memset(void *s, int c, size_t n) {
+    if (!use_rep(n)) return memset_words(s, c, n);
+
+    void *d = s;
+    asm volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+    return s;
+}
+
+void *memcpy(void *dest, const void *src, size_t n) {
+    if (!use_rep(n)) return memcpy_words(dest, src, n);
+
+    void *d = dest;
+    asm volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(n) :: "memory");
+    return dest;
+}
+
+/* Only the forward direction of rep movsb is fast; copy overlaps with dest above src backwards */
+void *memmove(void *dest, const void *src, size_t n) {
+    if ((uintptr_t)dest - (uintptr_t)src >= n) return memcpy(dest, src, n);
+    return memmove_words(dest, src, n);
+}
@@ -0,0 +1,80 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+/* Upper bound on CPUs the per-CPU tables are sized for */
+#define MAX_CPUS 64
+
+#define CACHE_LINE_SIZE 64
+
+#define RFLAGS_IF (1ull << 9)
+
+#define MSR_PAT 0x277
+
+#define CR4_PGE (1ull << 7)
+#define CR4_PCIDE (1ull << 17)
+
+/*
+ * Index of the CPU we are running on. Only the BSP runs kernel code until
+ * SMP bring-up exists; once APs are started this reads the per-CPU id.
+ */
+static inline uint32_t cpu_id(void) {
+    return 0;
+}
+
+/* Disable interrupts, returning the previous RFLAGS for irq_restore() */
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & RFLAGS_IF) asm volatile("sti" ::: "memory");
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    asm volatile("cpuid"
+                 : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                 : "a"(leaf), "c"(subleaf));
+}
+
+/* Highest supported leaf of the range `leaf` belongs to (0 or 0x80000000) */
+static inline uint32_t cpuid_max(uint32_t leaf) {
+    uint32_t a, b, c, d;
+    cpuid(leaf & 0x80000000, 0, &a, &b, &c, &d);
+    return a;
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4) {
+    asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+/* Write back and invalidate all caches, e.g. before changing memory types */
+static inline void wbinvd(void) {
+    asm volatile("wbinvd" ::: "memory");
+}
+
+static inline void cpu_relax(void) {
+    asm volatile("pause" ::: "memory");
+}
+
+#endif // CPU_H
@@ -1,143 +1,612 @@
 #include "kheap.h"
+#include "slab.h"
+#include "kheap_trace.h"
 #include "global.h"
 #include "kprint.h"
 #include "mmu/pmm.h"
 #include "mmu/vmm.h"
+#include "mmu/vmalloc.h"
+#include "spinlock.h"
 #include <string.h>
 #include <stdint.h>
 #include <stddef.h>
 
-#define HEAP_START 0xFFFF800010000000
-#define HEAP_MAX   0xFFFF800020000000
+/*
+ * The heap window sits outside the HHDM. It is reserved with the VMM and
+ * backed lazily by zero-filled pages on first touch, so address space the
+ * heap hands out costs nothing until it is used.
+ */
+#define HEAP_START 0xFFFF900000000000
+#define HEAP_MAX   0xFFFF900010000000
 #define PAGE_SIZE  0x1000
 
+/* kmalloc sizes above this get a dedicated page run from vmalloc */
+#define KHEAP_LARGE (4 * PAGE_SIZE)
+
+/*
+ * Two-level segregated fit. Every block starts with a 16-byte header
+ * whose first word is the boundary tag (footer) of the block before it,
+ * valid while that block is free. Free blocks are kept on one of
+ * FL_COUNT * SL_COUNT lists indexed by size, with bitmaps of the
+ * non-empty lists, so allocation, free and coalescing are O(1).
+ */
 typedef struct block_header {
-    size_t size;
-    int free;
-    struct block_header *next;
+    size_t prev_size;               /* size of the previous block, if it is free */
+    size_t size;                    /* payload bytes | BLOCK_FREE | PREV_FREE | BLOCK_TRIMMED */
+    struct block_header *next_free; /* free blocks only, overlaps the payload */
+    struct block_header *prev_free;
 } block_header_t;
 
+#define BLOCK_FREE   1UL
+#define PREV_FREE    2UL
+#define BLOCK_TRIMMED 4UL   /* free block whose interior pages are already unmapped */
+#define FLAG_MASK    (BLOCK_FREE | PREV_FREE | BLOCK_TRIMMED)
+#define HEADER_SIZE  (2 * sizeof(size_t))
+#define ALIGN_SHIFT  4
+#define MIN_PAYLOAD  (sizeof(block_header_t) - HEADER_SIZE)
+
+/* 16 second-level lists per power of two; sizes below 256 map linearly */
+#define SL_SHIFT     4
+#define SL_COUNT     (1 << SL_SHIFT)
+#define FL_SHIFT     (SL_SHIFT + ALIGN_SHIFT)
+#define SMALL_BLOCK  (1UL << FL_SHIFT)
+#define FL_COUNT     (40 - FL_SHIFT + 1)
+
+/* Grow by at least this much; the window is backed lazily anyway */
+#define HEAP_GROW    0x10000
+
+/* kheap_trim_idle() trims the heap once this many free bytes are still backed */
+#define HEAP_TRIM_THRESHOLD 0x100000
+
+static spinlock_t heap_lock = SPINLOCK_INIT;
 static uintptr_t heap_current = HEAP_START;
-static block_header_t *free_list = NULL;
+static uint64_t fl_bitmap = 0;
+static uint32_t sl_bitmap[FL_COUNT];
+static block_header_t *free_lists[FL_COUNT][SL_COUNT];
+static size_t free_bytes = 0;      /* payload of all listed free blocks */
+static size_t untrimmed_bytes = 0; /* the part of it not yet trimmed */
 
-static void grow_heap(size_t required_size) {
-    while (heap_current + required_size > vmm_resolve(heap_current)) {
-        uintptr_t phys = pmm_alloc_page();
-        if (!phys) {
-            kprint(LOG_ERR, "KHEAP: failed to grow heap\n");
-            return;
-        }
-        vmm_map(heap_current, phys, VMM_PRESENT | VMM_WRITE);
-        heap_current += PAGE_SIZE;
+static inline size_t block_size(block_header_t *b) {
+    return b->size & ~FLAG_MASK;
+}
+
+static inline void *block_payload(block_header_t *b) {
+    return (void *)((uintptr_t)b + HEADER_SIZE);
+}
+
+static inline block_header_t *block_of(void *ptr) {
+    return (block_header_t *)((uintptr_t)ptr - HEADER_SIZE);
+}
+
+static inline block_header_t *block_next(block_header_t *b) {
+    return (block_header_t *)((uintptr_t)b + HEADER_SIZE + block_size(b));
+}
+
+static inline block_header_t *block_prev(block_header_t *b) {
+    return (block_header_t *)((uintptr_t)b - HEADER_SIZE - b->prev_size);
+}
+
+static inline int fls_size(size_t x) {
+    return 63 - __builtin_clzll(x);
+}
+
+static void mapping(size_t size, int *fl, int *sl) {
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = (int)(size >> ALIGN_SHIFT);
+    } else {
+        int f = fls_size(size);
+        *sl = (int)(size >> (f - SL_SHIFT)) ^ SL_COUNT;
+        *fl = f - FL_SHIFT + 1;
     }
 }
 
-size_t kheap_init(void) {
-    heap_current = HEAP_START;
-    // Pre-map 1 page
-    uintptr_t phys = pmm_alloc_page();
-    if (!phys) {
-        kprint(LOG_ERR, "KHEAP: initial page allocation failed\n");
-        return 0;
+static void insert_free(block_header_t *b) {
+    int fl, sl;
+    mapping(block_size(b), &fl, &sl);
+
+    b->prev_free = NULL;
+    b->next_free = free_lists[fl][sl];
+    if (b->next_free) b->next_free->prev_free = b;
+    free_lists[fl][sl] = b;
+    fl_bitmap |= 1ULL << fl;
+    sl_bitmap[fl] |= 1U << sl;
+
+    free_bytes += block_size(b);
+    if (!(b->size & BLOCK_TRIMMED)) untrimmed_bytes += block_size(b);
+}
+
+static void remove_free(block_header_t *b) {
+    int fl, sl;
+    mapping(block_size(b), &fl, &sl);
+
+    if (b->prev_free) b->prev_free->next_free = b->next_free;
+    else free_lists[fl][sl] = b->next_free;
+    if (b->next_free) b->next_free->prev_free = b->prev_free;
+
+    if (!free_lists[fl][sl]) {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (!sl_bitmap[fl]) fl_bitmap &= ~(1ULL << fl);
     }
-    vmm_map(heap_current, phys, VMM_PRESENT | VMM_WRITE);
-    free_list = (block_header_t *)heap_current;
-    free_list->size = PAGE_SIZE - sizeof(block_header_t);
-    free_list->free = 1;
-    free_list->next = NULL;
-    if (debug) kprint(LOG_DEBUG, "KHEAP: initialized heap at %p\n", (void *)heap_current);
-    return free_list->size;
+
+    free_bytes -= block_size(b);
+    if (!(b->size & BLOCK_TRIMMED)) untrimmed_bytes -= block_size(b);
 }
 
-static void split_block(block_header_t *block, size_t size) {
-    if (block->size <= size + sizeof(block_header_t)) return;
+/* First block on a list whose every block holds `size`, or NULL */
+static block_header_t *find_fit(size_t size) {
+    // Round up to the next list boundary so any block on the list is big enough
+    if (size >= SMALL_BLOCK) size += (1UL << (fls_size(size) - SL_SHIFT)) - 1;
 
-    block_header_t *new_block = (block_header_t *)((uintptr_t)block + sizeof(block_header_t) + size);
-    new_block->size = block->size - size - sizeof(block_header_t);
-    new_block->free = 1;
-    new_block->next = block->next;
+    int fl, sl;
+    mapping(size, &fl, &sl);
+    if (fl >= FL_COUNT) return NULL;
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        uint64_t fl_map = fl + 1 < 64 ? fl_bitmap & (~0ULL << (fl + 1)) : 0;
+        if (!fl_map) return NULL;
+        fl = __builtin_ctzll(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    return free_lists[fl][__builtin_ctz(sl_map)];
+}
 
-    block->size = size;
-    block->next = new_block;
+/* Mark b free or used, keeping the next block's boundary tag in step; a used block is no longer trimmed */
+static void set_free(block_header_t *b, int free) {
+    block_header_t *next = block_next(b);
+    if (free) {
+        b->size |= BLOCK_FREE;
+        next->size |= PREV_FREE;
+        next->prev_size = block_size(b);
+    } else {
+        b->size &= ~(BLOCK_FREE | BLOCK_TRIMMED);
+        next->size &= ~PREV_FREE;
+    }
 }
 
-static void *request_more_memory(size_t size) {
-    size_t total_size = size + sizeof(block_header_t);
-    total_size = (total_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+/*
+ * Cut b down to `size`, returning the tail to the free lists. The tail's
+ * interior lies inside b's, so it stays trimmed if b was.
+ */
+static void split_block(block_header_t *b, size_t size) {
+    size_t total = block_size(b);
+    if (total < size + HEADER_SIZE + MIN_PAYLOAD) return;
 
-    uintptr_t alloc_base = heap_current;
-    for (size_t off = 0; off < total_size; off += PAGE_SIZE) {
-        uintptr_t phys = pmm_alloc_page();
-        if (!phys) return NULL;
-        vmm_map(alloc_base + off, phys, VMM_PRESENT | VMM_WRITE);
+    b->size = size | (b->size & FLAG_MASK);
+    block_header_t *rest = block_next(b);
+    rest->size = (total - size - HEADER_SIZE) | (b->size & BLOCK_TRIMMED);
+    set_free(rest, 1);
+    insert_free(rest);
+}
+
+/*
+ * Merge a free, unlisted block with free neighbours; returns the merged
+ * block. A merged block is untrimmed: only part of it may be unmapped.
+ */
+static block_header_t *coalesce(block_header_t *b) {
+    block_header_t *next = block_next(b);
+    if (next->size & BLOCK_FREE) {
+        remove_free(next);
+        b->size = (b->size & ~BLOCK_TRIMMED) + HEADER_SIZE + block_size(next);
+    }
+    if (b->size & PREV_FREE) {
+        block_header_t *prev = block_prev(b);
+        remove_free(prev);
+        prev->size = (prev->size & ~BLOCK_TRIMMED) + HEADER_SIZE + block_size(b);
+        b = prev;
+    }
+    set_free(b, 1);
+    return b;
+}
+
+/*
+ * Extend the heap by whole pages of reserved, not yet backed, address
+ * space. The old end marker becomes the header of the new free block,
+ * which counts as trimmed since none of its pages was ever backed.
+ * Sets *fresh if the block is untouched memory, i.e. reads as zero.
+ */
+static block_header_t *heap_grow(size_t size, int *fresh) {
+    size_t grow = (size + HEADER_SIZE + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    if (grow < HEAP_GROW) grow = HEAP_GROW;
+    if (grow > HEAP_MAX - heap_current) {
+        grow = HEAP_MAX - heap_current;
+        if (grow < size + HEADER_SIZE) return NULL;
     }
 
-    heap_current += total_size;
+    block_header_t *b = (block_header_t *)(heap_current - HEADER_SIZE);
+    b->size = (grow - HEADER_SIZE) | (b->size & PREV_FREE) | BLOCK_TRIMMED;
+    heap_current += grow;
 
-    block_header_t *block = (block_header_t *)alloc_base;
-    block->size = total_size - sizeof(block_header_t);
-    block->free = 0;
-    block->next = NULL;
-    return (void *)((uintptr_t)block + sizeof(block_header_t));
+    block_header_t *end = block_next(b);
+    end->size = 0; // zero-sized, never free: stops coalescing at the top
+
+    *fresh = !(b->size & PREV_FREE);
+    return coalesce(b);
 }
 
-void *kheap_alloc(size_t size) {
+size_t kheap_init(void) {
+    slab_init();
+
+    if (vmm_reserve_region(HEAP_START, HEAP_MAX, VMM_WRITE, VMM_FAULT_ZERO) != 0) {
+        kprint(LOG_ERR, "KHEAP: could not reserve the heap window\n");
+        return 0;
+    }
+
+    // Just an end marker; the first page is backed when it is written
+    heap_current = HEAP_START + HEADER_SIZE;
+    block_header_t *end = (block_header_t *)HEAP_START;
+    end->size = 0;
+
+    int fresh;
+    block_header_t *first = heap_grow(PAGE_SIZE - 2 * HEADER_SIZE, &fresh);
+    insert_free(first);
+    if (debug) kprint(LOG_DEBUG, "KHEAP: initialized heap at %p\n", (void *)HEAP_START);
+    return block_size(first);
+}
+
+/* Only reused blocks need clearing for `zero`; fresh heap pages fault in zeroed */
+static void *heap_alloc(size_t size, int zero) {
     if (size == 0) return NULL;
     size = (size + 15) & ~15ULL;
+    if (size < MIN_PAYLOAD) size = MIN_PAYLOAD;
 
-    block_header_t *curr = free_list;
-    while (curr) {
-        if (curr->free && curr->size >= size) {
-            split_block(curr, size);
-            curr->free = 0;
-            return (void *)((uintptr_t)curr + sizeof(block_header_t));
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    int fresh = 0;
+    block_header_t *b = find_fit(size);
+    if (b) {
+        remove_free(b);
+    } else {
+        b = heap_grow(size, &fresh);
+        if (!b) {
+            spin_unlock_irqrestore(&heap_lock, flags);
+            kprint(LOG_ERR, "KHEAP: out of memory!\n");
+            return NULL;
         }
-        if (!curr->next) break;
-        curr = curr->next;
     }
 
-    void *new_block = request_more_memory(size);
-    if (!new_block) {
-        kprint(LOG_ERR, "KHEAP: out of memory!\n");
-        return NULL;
+    split_block(b, size);
+    set_free(b, 0);
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    void *ptr = block_payload(b);
+    if (zero && !fresh) memset(ptr, 0, size);
+    return ptr;
+}
+
+void *kheap_alloc(size_t size) {
+    return heap_alloc(size, 0);
+}
+
+/*
+ * Find a block with room for `size` at any `align` boundary, then give the
+ * gap in front of that boundary and the tail after `size` back as free
+ * blocks, so only the search, not the allocation, pays for the alignment.
+ */
+static void *heap_alloc_aligned(size_t size, size_t align) {
+    size = (size + 15) & ~15ULL;
+    if (size < MIN_PAYLOAD) size = MIN_PAYLOAD;
+    size_t span = size + align + HEADER_SIZE + MIN_PAYLOAD;
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    int fresh;
+    block_header_t *b = find_fit(span);
+    if (b) {
+        remove_free(b);
+    } else {
+        b = heap_grow(span, &fresh);
+        if (!b) {
+            spin_unlock_irqrestore(&heap_lock, flags);
+            kprint(LOG_ERR, "KHEAP: out of memory!\n");
+            return NULL;
+        }
     }
 
-    curr->next = (block_header_t *)((uintptr_t)new_block - sizeof(block_header_t));
-    return new_block;
+    uintptr_t payload = (uintptr_t)block_payload(b);
+    uintptr_t aligned = (payload + align - 1) & ~(uintptr_t)(align - 1);
+    if (aligned != payload) {
+        // The gap must be able to stand as a free block of its own
+        while (aligned - payload < HEADER_SIZE + MIN_PAYLOAD) aligned += align;
+
+        block_header_t *a = block_of((void *)aligned);
+        a->size = (block_size(b) - (aligned - payload)) | (b->size & BLOCK_TRIMMED);
+        b->size = (aligned - payload - HEADER_SIZE) | (b->size & (PREV_FREE | BLOCK_TRIMMED));
+        set_free(b, 1);
+        insert_free(b);
+        b = a;
+    }
+
+    split_block(b, size);
+    set_free(b, 0);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return block_payload(b);
+}
+
+/*
+ * Grow a heap block to `size` without moving it, by absorbing a free
+ * successor or by extending the heap when the block is the last one.
+ * Shrinking leaves the block as it is. Returns 0 if it cannot grow.
+ */
+static int heap_resize(void *ptr, size_t size) {
+    size = (size + 15) & ~15ULL;
+    if (size < MIN_PAYLOAD) size = MIN_PAYLOAD;
+
+    block_header_t *b = block_of(ptr);
+    if (size <= block_size(b)) return 1;
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    block_header_t *next = block_next(b);
+    block_header_t *extra = NULL;
+
+    if ((next->size & BLOCK_FREE) && block_size(b) + HEADER_SIZE + block_size(next) >= size) {
+        remove_free(next);
+        extra = next;
+    } else if (block_size(next) == 0) {
+        // Only the end marker is empty: b is the top block
+        int fresh;
+        extra = heap_grow(size - block_size(b), &fresh);
+    }
+
+    if (extra) {
+        // What split_block() cuts off comes out of extra
+        b->size = (b->size | (extra->size & BLOCK_TRIMMED)) + HEADER_SIZE + block_size(extra);
+        split_block(b, size);
+        set_free(b, 0);
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return extra != NULL;
 }
 
 void kheap_free(void *ptr) {
     if (!ptr) return;
 
-    block_header_t *block = (block_header_t *)((uintptr_t)ptr - sizeof(block_header_t));
-    block->free = 1;
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    block_header_t *b = block_of(ptr);
+    insert_free(coalesce(b));
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
 
-    block_header_t *curr = free_list;
-    while (curr) {
-        if (curr->free && curr->next && curr->next->free) {
-            curr->size += sizeof(block_header_t) + curr->next->size;
-            curr->next = curr->next->next;
-        } else {
-            curr = curr->next;
+/*
+ * Unmap the whole pages inside free blocks and give their frames back.
+ * A free block's own header and list links stay mapped, and its boundary
+ * tag lives in the next block's header, so only the interior is touched.
+ * Reusing a trimmed block faults zeroed pages back in on demand.
+ * Trimmed blocks are marked so later passes skip them until they are
+ * allocated or merged again. The lock is only held for one list at a
+ * time; blocks that move meanwhile are left for the next pass.
+ */
+size_t kheap_trim(void) {
+    size_t trimmed = 0;
+
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        for (int sl = 0; sl < SL_COUNT; sl++) {
+            uint64_t flags = spin_lock_irqsave(&heap_lock);
+            for (block_header_t *b = free_lists[fl][sl]; b; b = b->next_free) {
+                if (b->size & BLOCK_TRIMMED) continue;
+                b->size |= BLOCK_TRIMMED;
+                untrimmed_bytes -= block_size(b);
+
+                uintptr_t start = ((uintptr_t)b + sizeof(block_header_t) + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+                uintptr_t end = (uintptr_t)block_next(b) & ~(uintptr_t)(PAGE_SIZE - 1);
+                if (start >= end) continue;
+
+                vmm_unmap_range_free(start, end - start);
+                trimmed += end - start;
+            }
+            spin_unlock_irqrestore(&heap_lock, flags);
         }
     }
+    return trimmed;
 }
 
-void *kmalloc(size_t size) {
+size_t kheap_trim_idle(void) {
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    int trim = untrimmed_bytes >= HEAP_TRIM_THRESHOLD;
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    return trim ? kheap_trim() : 0;
+}
+
+void kheap_stats(size_t *size, size_t *free, size_t *largest) {
+    size_t max = 0;
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        if (!(fl_bitmap & (1ULL << fl))) continue;
+        for (int sl = 0; sl < SL_COUNT; sl++) {
+            for (block_header_t *b = free_lists[fl][sl]; b; b = b->next_free) {
+                if (block_size(b) > max) max = block_size(b);
+            }
+        }
+    }
+    *size = heap_current - HEAP_START;
+    *free = free_bytes;
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    *largest = max;
+}
+
+/*
+ * Small sizes go to the slab classes, mid sizes to the TLSF heap. Large
+ * ones get their own page run in the vmalloc area, so kfree hands the
+ * pages straight back to the PMM instead of pinning heap space.
+ */
+static void *do_kmalloc(size_t size) {
+    if (size && size <= SLAB_MAX_SIZE) return slab_alloc(size);
+    if (size > KHEAP_LARGE) return vmalloc(size);
     return kheap_alloc(size);
 }
 
+static void *do_kzalloc(size_t size) {
+    if (size && size <= SLAB_MAX_SIZE) {
+        void *ptr = slab_alloc(size);
+        if (ptr) memset(ptr, 0, size);
+        return ptr;
+    }
+    if (size > KHEAP_LARGE) return vzalloc(size);
+    return heap_alloc(size, 1);
+}
+
+/* The TLSF heap owns the heap window, large runs the vmalloc area; slabs live in the HHDM */
+static void do_kfree(void *ptr) {
+    if ((uintptr_t)ptr >= HEAP_START && (uintptr_t)ptr < HEAP_MAX)
+        kheap_free(ptr);
+    else if (is_vmalloc_addr(ptr))
+        vfree(ptr);
+    else
+        slab_free(ptr);
+}
+
+static void *do_krealloc(void *ptr, size_t size) {
+    size_t old;
+    if ((uintptr_t)ptr >= HEAP_START && (uintptr_t)ptr < HEAP_MAX) {
+        if (heap_resize(ptr, size)) return ptr;
+        old = block_size(block_of(ptr));
+    } else if (is_vmalloc_addr(ptr)) {
+        old = vmalloc_size(ptr);
+        if (size <= old) return ptr;
+        // Frames are remapped rather than copied; still double to keep appends cheap
+        return vrealloc(ptr, size < 2 * old ? 2 * old : size);
+    } else {
+        old = slab_usable(ptr);
+        if (size <= old) return ptr;
+    }
+
+    // Move, at least doubling so repeated appends copy O(n) bytes in total
+    void *new_ptr = do_kmalloc(size < 2 * old ? 2 * old : size);
+    if (!new_ptr) new_ptr = do_kmalloc(size);
+    if (!new_ptr) return NULL;
+    memcpy(new_ptr, ptr, old);
+    do_kfree(ptr);
+    return new_ptr;
+}
+
+/* Public entry points; the trace hooks see the caller's return address */
+void *kmalloc(size_t size) {
+    void *ptr = do_kmalloc(size);
+    kheap_trace_alloc(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
+
 void *kzalloc(size_t size) {
-    void *ptr = kmalloc(size);
-    if (ptr) memset(ptr, 0, size);
+    void *ptr = do_kzalloc(size);
+    kheap_trace_alloc(ptr, size, __builtin_return_address(0));
     return ptr;
 }
 
+void *krealloc(void *ptr, size_t size) {
+    if (!ptr) {
+        ptr = do_kmalloc(size);
+        kheap_trace_alloc(ptr, size, __builtin_return_address(0));
+        return ptr;
+    }
+    if (!size) {
+        kheap_trace_free(ptr);
+        do_kfree(ptr);
+        return NULL;
+    }
+
+    void *new_ptr = do_krealloc(ptr, size);
+    if (new_ptr) {
+        kheap_trace_free(ptr);
+        kheap_trace_alloc(new_ptr, size, __builtin_return_address(0));
+    }
+    return new_ptr;
+}
+
 void *kcalloc(size_t n, size_t size) {
     if (n && size && n > (SIZE_MAX / size)) return NULL;
-    return kzalloc(n * size);
+    void *ptr = do_kzalloc(n * size);
+    kheap_trace_alloc(ptr, n * size, __builtin_return_address(0));
+    return ptr;
 }
 
 void kfree(void *ptr) {
-    kheap_free(ptr);
+    if (!ptr) return;
+    kheap_trace_free(ptr);
+    do_kfree(ptr);
+}
+
+/*
+ * Slab classes are naturally aligned, so small requests just move up a
+ * class; vmalloc runs start on a page. Only the TLSF range needs an
+ * aligned search.
+ */
+void *kmalloc_aligned(size_t size, size_t align) {
+    if (align & (align - 1) || align > PAGE_SIZE) {
+        kprint(LOG_ERR, "KHEAP: unsupported alignment %zu\n", align);
+        return NULL;
+    }
+
+    void *ptr;
+    if (!size || align <= 16)
+        ptr = do_kmalloc(size);
+    else if (size <= SLAB_MAX_SIZE && align <= SLAB_MAX_SIZE)
+        ptr = slab_alloc(size < align ? align : size);
+    else if (size > KHEAP_LARGE)
+        ptr = vmalloc(size);
+    else
+        ptr = heap_alloc_aligned(size, align);
+
+    kheap_trace_alloc(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
+
+/*
+ * Buddy blocks are aligned on their size: take the smallest block that
+ * covers both `count` and `align`, and free the pages past `count` again.
+ */
+static void *alloc_pages(size_t count, size_t align) {
+    if (!count || align & (align - 1)) return NULL;
+    if (count == 1 && align <= PAGE_SIZE) {
+        uintptr_t phys = pmm_alloc_page();
+        return phys ? phys_to_virt(phys) : NULL;
+    }
+
+    size_t span = align > PAGE_SIZE ? align / PAGE_SIZE : 1;
+    unsigned int order = pmm_order_for(count > span ? count : span);
+    if (order > PMM_MAX_ORDER) {
+        kprint(LOG_ERR, "KHEAP: %zu pages at alignment %zu exceed a buddy block\n", count, align);
+        return NULL;
+    }
+
+    uintptr_t phys = pmm_alloc_pages(order);
+    if (!phys) return NULL;
+    if (count < ((size_t)1 << order))
+        pmm_free_range(phys + count * PAGE_SIZE, ((size_t)1 << order) - count);
+    return phys_to_virt(phys);
+}
+
+void *kmalloc_pages(size_t count) {
+    void *ptr = alloc_pages(count, PAGE_SIZE);
+    kheap_trace_alloc(ptr, count * PAGE_SIZE, __builtin_return_address(0));
+    return ptr;
+}
+
+void *kmalloc_pages_aligned(size_t count, size_t align) {
+    void *ptr = alloc_pages(count, align);
+    kheap_trace_alloc(ptr, count * PAGE_SIZE, __builtin_return_address(0));
+    return ptr;
+}
+
+void *kzalloc_pages(size_t count) {
+    void *ptr;
+    if (count == 1) {
+        uintptr_t phys = pmm_alloc_zeroed_page();
+        ptr = phys ? phys_to_virt(phys) : NULL;
+    } else {
+        ptr = alloc_pages(count, PAGE_SIZE);
+        if (ptr) memset(ptr, 0, count * PAGE_SIZE);
+    }
+    kheap_trace_alloc(ptr, count * PAGE_SIZE, __builtin_return_address(0));
+    return ptr;
+}
+
+void kfree_pages(void *ptr, size_t count) {
+    if (!ptr || !count) return;
+    kheap_trace_free(ptr);
+    if (count == 1)
+        pmm_free_page(virt_to_phys(ptr));
+    else
+        pmm_free_range(virt_to_phys(ptr), count);
 }
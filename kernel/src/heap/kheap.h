@@ -7,14 +7,37 @@
 // Initialize heap
 size_t kheap_init(void);
 
-// Core bump allocator
+// Core TLSF allocator
 void *kheap_alloc(size_t size);
 void  kheap_free(void *ptr);
 
+// Return whole free heap pages to the PMM
+size_t kheap_trim(void);
+
+// Trim once enough free heap is still backed; call from idle loops
+size_t kheap_trim_idle(void);
+
+// Bytes spanned by the TLSF heap, free inside it, and in its largest free block
+void kheap_stats(size_t *size, size_t *free, size_t *largest);
+
 // Wrappers
 void *kmalloc(size_t size);
 void *kzalloc(size_t size);
 void *kcalloc(size_t n, size_t size);
 void  kfree(void *ptr);
 
+// Resize, in place when the next heap block is free or at the heap top
+void *krealloc(void *ptr, size_t size);
+
+// Memory starting on an `align` boundary (a power of two up to a page); free
+// with kfree. krealloc does not keep the alignment if it has to move the block.
+void *kmalloc_aligned(size_t size, size_t align);
+
+// Physically contiguous pages through the HHDM, aligned on `align` bytes for
+// the _aligned variant; free with kfree_pages and the same count
+void *kmalloc_pages(size_t count);
+void *kmalloc_pages_aligned(size_t count, size_t align);
+void *kzalloc_pages(size_t count);
+void  kfree_pages(void *ptr, size_t count);
+
 #endif // KHEAP_H
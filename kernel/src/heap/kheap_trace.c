@@ -0,0 +1,185 @@
+#ifdef KHEAP_TRACE
+
+#include "kheap_trace.h"
+#include "kheap.h"
+#include "kprint.h"
+#include "spinlock.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * All bookkeeping is static: the tracer sits under kmalloc and must not
+ * allocate. Live blocks are kept in an open-addressed table keyed by
+ * address, each pointing at its call site in a second, smaller table.
+ * Blocks that do not fit are counted but not tracked.
+ */
+#define TRACE_BLOCK_BITS   14
+#define TRACE_BLOCKS       (1u << TRACE_BLOCK_BITS)
+#define TRACE_SITE_BITS    8
+#define TRACE_SITES        (1u << TRACE_SITE_BITS)
+#define TRACE_BUCKETS      64
+#define TRACE_REPORT_SITES 32
+
+typedef struct trace_block {
+    void *ptr;        /* NULL if the slot is empty */
+    size_t size;
+    uint32_t site;
+} trace_block_t;
+
+typedef struct trace_site {
+    void *site;       /* return address of the kmalloc caller */
+    uint64_t allocs;
+    uint64_t live;
+    size_t live_bytes;
+} trace_site_t;
+
+static trace_block_t blocks[TRACE_BLOCKS];
+static trace_site_t sites[TRACE_SITES];
+static uint64_t histogram[TRACE_BUCKETS]; /* bucket n: sizes in (2^(n-1), 2^n] */
+
+static uint64_t total_allocs;
+static uint64_t live_blocks;
+static size_t live_bytes;
+static size_t peak_bytes;
+static uint64_t untracked;
+
+static spinlock_t trace_lock = SPINLOCK_INIT;
+
+static inline uint32_t hash_ptr(const void *p, unsigned bits) {
+    return (uint32_t)(((uintptr_t)p * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+static inline unsigned size_bucket(size_t size) {
+    return size <= 1 ? 0 : 64 - (unsigned)__builtin_clzll(size - 1);
+}
+
+/* Slot for `site`, claiming an empty one; TRACE_SITES if the table is full */
+static uint32_t site_slot(void *site) {
+    uint32_t i = hash_ptr(site, TRACE_SITE_BITS);
+    for (uint32_t n = 0; n < TRACE_SITES; n++, i = (i + 1) & (TRACE_SITES - 1)) {
+        if (sites[i].site == site) return i;
+        if (!sites[i].site) {
+            sites[i].site = site;
+            return i;
+        }
+    }
+    return TRACE_SITES;
+}
+
+static uint32_t block_slot(const void *ptr) {
+    uint32_t i = hash_ptr(ptr, TRACE_BLOCK_BITS);
+    while (blocks[i].ptr && blocks[i].ptr != ptr) i = (i + 1) & (TRACE_BLOCKS - 1);
+    return i;
+}
+
+/* Empty slot i, shifting later entries of the probe run back so lookups still find them */
+static void block_remove(uint32_t i) {
+    uint32_t j = i;
+    for (;;) {
+        j = (j + 1) & (TRACE_BLOCKS - 1);
+        if (!blocks[j].ptr) break;
+
+        uint32_t home = hash_ptr(blocks[j].ptr, TRACE_BLOCK_BITS);
+        // Move j into the hole unless its home lies cyclically in (i, j]
+        if (((j - home) & (TRACE_BLOCKS - 1)) >= ((j - i) & (TRACE_BLOCKS - 1))) {
+            blocks[i] = blocks[j];
+            i = j;
+        }
+    }
+    blocks[i].ptr = NULL;
+}
+
+void kheap_trace_alloc(void *ptr, size_t size, void *site) {
+    if (!ptr) return;
+
+    uint64_t flags = spin_lock_irqsave(&trace_lock);
+    total_allocs++;
+    histogram[size_bucket(size)]++;
+
+    uint32_t s = site_slot(site);
+    if (s == TRACE_SITES || live_blocks >= TRACE_BLOCKS * 3 / 4) {
+        untracked++;
+        spin_unlock_irqrestore(&trace_lock, flags);
+        return;
+    }
+
+    uint32_t i = block_slot(ptr);
+    blocks[i].ptr = ptr;
+    blocks[i].size = size;
+    blocks[i].site = s;
+
+    sites[s].allocs++;
+    sites[s].live++;
+    sites[s].live_bytes += size;
+    live_blocks++;
+    live_bytes += size;
+    if (live_bytes > peak_bytes) peak_bytes = live_bytes;
+    spin_unlock_irqrestore(&trace_lock, flags);
+}
+
+void kheap_trace_free(void *ptr) {
+    if (!ptr) return;
+
+    uint64_t flags = spin_lock_irqsave(&trace_lock);
+    uint32_t i = block_slot(ptr);
+    if (blocks[i].ptr) {
+        trace_site_t *s = &sites[blocks[i].site];
+        s->live--;
+        s->live_bytes -= blocks[i].size;
+        live_blocks--;
+        live_bytes -= blocks[i].size;
+        block_remove(i);
+    }
+    spin_unlock_irqrestore(&trace_lock, flags);
+}
+
+/*
+ * Printing allocates through kmalloc, so everything is copied out under
+ * the lock first and printed after it is dropped.
+ */
+void kheap_trace_report(void) {
+    static trace_site_t top[TRACE_REPORT_SITES];
+    static uint64_t hist[TRACE_BUCKETS];
+    size_t ntop = 0;
+
+    uint64_t flags = spin_lock_irqsave(&trace_lock);
+    uint64_t allocs = total_allocs, nlive = live_blocks, lost = untracked;
+    size_t bytes = live_bytes, peak = peak_bytes;
+    for (unsigned b = 0; b < TRACE_BUCKETS; b++) hist[b] = histogram[b];
+
+    // Keep the TRACE_REPORT_SITES sites holding the most bytes, largest first
+    for (uint32_t i = 0; i < TRACE_SITES; i++) {
+        if (!sites[i].live) continue;
+        size_t pos = ntop;
+        while (pos > 0 && top[pos - 1].live_bytes < sites[i].live_bytes) pos--;
+        if (pos >= TRACE_REPORT_SITES) continue;
+        if (ntop < TRACE_REPORT_SITES) ntop++;
+        for (size_t k = ntop - 1; k > pos; k--) top[k] = top[k - 1];
+        top[pos] = sites[i];
+    }
+    spin_unlock_irqrestore(&trace_lock, flags);
+
+    size_t heap_size, heap_free, heap_largest;
+    kheap_stats(&heap_size, &heap_free, &heap_largest);
+
+    kprint(LOG_INFO, "KHEAP: %zu bytes live in %lu blocks, peak %zu, %lu allocations\n",
+           bytes, nlive, peak, allocs);
+    kprint(LOG_INFO, "KHEAP: TLSF heap %zu bytes, %zu free, largest free block %zu\n",
+           heap_size, heap_free, heap_largest);
+    if (lost) kprint(LOG_WARN, "KHEAP: %lu allocations were not tracked\n", lost);
+
+    kprint(LOG_INFO, "KHEAP: allocations by size\n");
+    for (unsigned b = 0; b < TRACE_BUCKETS; b++) {
+        if (hist[b]) kprint(LOG_INFO, "  <= %10lu: %lu\n", 1ul << b, hist[b]);
+    }
+
+    kprint(LOG_INFO, "KHEAP: live memory by call site\n");
+    for (size_t i = 0; i < ntop; i++) {
+        kprint(LOG_INFO, "  %p: %lu blocks, %zu bytes (%lu allocated)\n",
+               top[i].site, top[i].live, top[i].live_bytes, top[i].allocs);
+    }
+}
+
+#endif // KHEAP_TRACE
@@ -0,0 +1,28 @@
+#ifndef KHEAP_TRACE_H
+#define KHEAP_TRACE_H
+
+#include <stddef.h>
+
+/*
+ * Heap instrumentation, built in with KHEAP_TRACE=1. Every kmalloc-family
+ * call records its size and call site; kheap_trace_report() prints live and
+ * peak usage, a size histogram and the call sites still holding memory.
+ * Without KHEAP_TRACE the hooks are empty and compile away.
+ */
+#ifdef KHEAP_TRACE
+
+void kheap_trace_alloc(void *ptr, size_t size, void *site);
+void kheap_trace_free(void *ptr);
+void kheap_trace_report(void);
+
+#else
+
+static inline void kheap_trace_alloc(void *ptr, size_t size, void *site) {
+    (void)ptr; (void)size; (void)site;
+}
+static inline void kheap_trace_free(void *ptr) { (void)ptr; }
+static inline void kheap_trace_report(void) {}
+
+#endif
+
+#endif // KHEAP_TRACE_H
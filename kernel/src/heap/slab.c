@@ -0,0 +1,334 @@
+#include "slab.h"
+#include "kheap_trace.h"
+#include "global.h"
+#include "kprint.h"
+#include "spinlock.h"
+#include "cpu/cpu.h"
+#include "mmu/pmm.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * A slab is a SLAB_SIZE block from the PMM, used through the HHDM, with
+ * this header at its start and equal-sized objects after it. Free objects
+ * are chained through a link word: their first word, or for caches with
+ * a constructor a word just past the object, so constructed state survives.
+ *
+ * Each CPU owns one slab per cache and allocates from and frees into it
+ * with interrupts off and no lock. Other CPUs push their frees onto the
+ * slab's lock-free `remote` list, which the owner takes over in a single
+ * exchange once its local list runs dry. A slab with no owner is shared:
+ * it is guarded by the cache lock and its remote list is closed.
+ */
+#define SLAB_NO_OWNER   UINT32_MAX
+#define REMOTE_CLOSED   ((void *)1)
+
+typedef struct slab {
+    struct slab_cache *cache;
+    struct slab *prev;
+    struct slab *next;
+    void *free;        /* owner-local, or under the cache lock when shared */
+    void *remote;      /* frees from other CPUs, or REMOTE_CLOSED */
+    uint32_t owner;
+    uint32_t inuse;
+    uint32_t total;
+} slab_t;
+
+/* Padded so CPUs never share a line on the fast path */
+typedef struct slab_cpu {
+    slab_t *current;
+} __attribute__((aligned(CACHE_LINE_SIZE))) slab_cpu_t;
+
+/* Shared slabs with free objects sit on `partial`; full ones are on no list */
+typedef struct slab_cache {
+    const char *name;
+    size_t obj_size;
+    size_t stride;     /* distance between objects */
+    size_t link;       /* offset of the free-list link inside an object slot */
+    size_t first;      /* offset of the first object in a slab */
+    uint32_t per_slab;
+    void (*ctor)(void *);
+    slab_t *partial;
+    spinlock_t lock;
+    slab_cpu_t cpu[MAX_CPUS];
+} slab_cache_t;
+
+#define SLAB_CLASSES 8
+
+static slab_cache_t kmalloc_caches[SLAB_CLASSES];
+
+/* kmem_cache_t descriptors are themselves allocated from this cache */
+static slab_cache_t cache_cache;
+
+static inline size_t size_class(size_t size) {
+    if (size <= SLAB_MIN_SIZE) return 0;
+    return (size_t)(64 - __builtin_clzll(size - 1)) - 4;
+}
+
+static inline slab_t *slab_of(void *obj) {
+    return (slab_t *)((uintptr_t)obj & ~(SLAB_SIZE - 1));
+}
+
+static inline void **link_of(slab_cache_t *c, void *obj) {
+    return (void **)((uintptr_t)obj + c->link);
+}
+
+static void cache_setup(slab_cache_t *c, const char *name, size_t size, size_t align,
+                        void (*ctor)(void *)) {
+    c->name = name;
+    c->obj_size = size;
+    // Constructed objects keep their first word, so their link goes just past them
+    c->link = ctor ? (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1) : 0;
+    size_t slot = ctor ? c->link + sizeof(void *) : size;
+    if (slot < sizeof(void *)) slot = sizeof(void *);
+    c->stride = (slot + align - 1) & ~(align - 1);
+    c->first = (sizeof(slab_t) + align - 1) & ~(align - 1);
+    c->per_slab = (uint32_t)((SLAB_SIZE - c->first) / c->stride);
+    c->ctor = ctor;
+    c->partial = NULL;
+    c->lock = (spinlock_t)SPINLOCK_INIT;
+    for (size_t i = 0; i < MAX_CPUS; i++) {
+        c->cpu[i].current = NULL;
+    }
+}
+
+static void list_add(slab_cache_t *c, slab_t *s) {
+    s->prev = NULL;
+    s->next = c->partial;
+    if (c->partial) c->partial->prev = s;
+    c->partial = s;
+}
+
+static void list_del(slab_cache_t *c, slab_t *s) {
+    if (s->prev) s->prev->next = s->next;
+    else c->partial = s->next;
+    if (s->next) s->next->prev = s->prev;
+}
+
+static slab_t *slab_create(slab_cache_t *c) {
+    uintptr_t phys = pmm_alloc_pages(SLAB_ORDER);
+    if (!phys) return NULL;
+
+    slab_t *s = (slab_t *)phys_to_virt(phys);
+    s->cache = c;
+    s->inuse = 0;
+    s->total = c->per_slab;
+    s->owner = SLAB_NO_OWNER;
+    s->remote = REMOTE_CLOSED;
+
+    // Chain the objects in address order, constructing them on the way
+    uintptr_t obj = (uintptr_t)s + c->first;
+    s->free = (void *)obj;
+    for (uint32_t i = 0; i < c->per_slab; i++, obj += c->stride) {
+        if (c->ctor) c->ctor((void *)obj);
+        *link_of(c, (void *)obj) = (i + 1 < c->per_slab) ? (void *)(obj + c->stride) : NULL;
+    }
+    return s;
+}
+
+void slab_init(void) {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        // Power-of-two classes are naturally aligned
+        size_t size = (size_t)SLAB_MIN_SIZE << i;
+        cache_setup(&kmalloc_caches[i], "kmalloc", size, size, NULL);
+    }
+    cache_setup(&cache_cache, "kmem_cache", sizeof(slab_cache_t), _Alignof(slab_cache_t), NULL);
+}
+
+/* Move a chain of remotely freed objects onto the owner's local list */
+static void take_remote(slab_t *s, void *list) {
+    while (list) {
+        void *next = *link_of(s->cache, list);
+        *link_of(s->cache, list) = s->free;
+        s->free = list;
+        s->inuse--;
+        list = next;
+    }
+}
+
+/* Give up an exhausted CPU slab and adopt a shared one with free objects */
+static slab_t *switch_slab(slab_cache_t *c, slab_t *old, uint32_t cpu) {
+    spin_lock(&c->lock);
+
+    if (old) {
+        // Frees that beat the close are ours; later ones see no owner and take the lock
+        take_remote(old, __atomic_exchange_n(&old->remote, REMOTE_CLOSED, __ATOMIC_ACQUIRE));
+        __atomic_store_n(&old->owner, SLAB_NO_OWNER, __ATOMIC_RELEASE);
+        if (old->free) list_add(c, old);
+    }
+
+    slab_t *s = c->partial;
+    if (s) list_del(c, s);
+    else s = slab_create(c);
+
+    if (s) {
+        __atomic_store_n(&s->remote, NULL, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->owner, cpu, __ATOMIC_RELEASE);
+    }
+
+    spin_unlock(&c->lock);
+    return s;
+}
+
+static void *cache_alloc(slab_cache_t *c) {
+    uint64_t flags = irq_save();
+    uint32_t cpu = cpu_id();
+    slab_t *s = c->cpu[cpu].current;
+
+    void *obj = s ? s->free : NULL;
+    if (!obj && s) {
+        take_remote(s, __atomic_exchange_n(&s->remote, NULL, __ATOMIC_ACQUIRE));
+        obj = s->free;
+    }
+    if (!obj) {
+        s = switch_slab(c, s, cpu);
+        c->cpu[cpu].current = s;
+        if (!s) {
+            irq_restore(flags);
+            return NULL;
+        }
+        obj = s->free;
+    }
+
+    s->free = *link_of(c, obj);
+    s->inuse++;
+
+    irq_restore(flags);
+    return obj;
+}
+
+/* Push onto another CPU's slab; false if the owner closed it meanwhile */
+static bool free_remote(slab_t *s, void *obj) {
+    void *head = __atomic_load_n(&s->remote, __ATOMIC_RELAXED);
+    do {
+        if (head == REMOTE_CLOSED) return false;
+        *link_of(s->cache, obj) = head;
+    } while (!__atomic_compare_exchange_n(&s->remote, &head, obj, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return true;
+}
+
+/* Free into a shared slab; false if a CPU adopted it meanwhile */
+static bool free_shared(slab_cache_t *c, slab_t *s, void *obj) {
+    spin_lock(&c->lock);
+    if (__atomic_load_n(&s->owner, __ATOMIC_ACQUIRE) != SLAB_NO_OWNER) {
+        spin_unlock(&c->lock);
+        return false;
+    }
+
+    if (!s->free) list_add(c, s);
+    *link_of(c, obj) = s->free;
+    s->free = obj;
+    s->inuse--;
+
+    // Keep one empty slab around so a single alloc/free pair cannot thrash the PMM
+    bool release = s->inuse == 0 && (c->partial != s || s->next);
+    if (release) list_del(c, s);
+
+    spin_unlock(&c->lock);
+
+    if (release) pmm_free_pages(virt_to_phys(s), SLAB_ORDER);
+    return true;
+}
+
+static void cache_free(slab_cache_t *c, slab_t *s, void *obj) {
+    uint64_t flags = irq_save();
+    uint32_t cpu = cpu_id();
+
+    for (;;) {
+        uint32_t owner = __atomic_load_n(&s->owner, __ATOMIC_ACQUIRE);
+        if (owner == cpu) {
+            // Only this CPU can hand the slab off, and it cannot be interrupted
+            *link_of(c, obj) = s->free;
+            s->free = obj;
+            s->inuse--;
+            break;
+        }
+        if (owner != SLAB_NO_OWNER ? free_remote(s, obj) : free_shared(c, s, obj))
+            break;
+        cpu_relax();
+    }
+
+    irq_restore(flags);
+}
+
+void *slab_alloc(size_t size) {
+    return cache_alloc(&kmalloc_caches[size_class(size)]);
+}
+
+void slab_free(void *ptr) {
+    slab_t *s = slab_of(ptr);
+    cache_free(s->cache, s, ptr);
+}
+
+size_t slab_usable(void *ptr) {
+    return slab_of(ptr)->cache->obj_size;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *)) {
+    if (!align) align = CACHE_LINE_SIZE;
+    if ((align & (align - 1)) || align > SLAB_SIZE / 2) {
+        kprint(LOG_ERR, "SLAB: %s: bad alignment %zu\n", name, align);
+        return NULL;
+    }
+    if (align < sizeof(void *)) align = sizeof(void *);
+
+    kmem_cache_t *c = cache_alloc(&cache_cache);
+    if (!c) return NULL;
+
+    cache_setup(c, name, size ? size : 1, align, ctor);
+    if (!c->per_slab) {
+        kprint(LOG_ERR, "SLAB: %s: %zu-byte objects do not fit a slab\n", name, size);
+        cache_free(&cache_cache, slab_of(c), c);
+        return NULL;
+    }
+
+    if (debug) kprint(LOG_DEBUG, "SLAB: cache %s, %zu-byte objects, %u per slab\n",
+                      name, c->stride, c->per_slab);
+    return c;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    void *obj = cache_alloc(cache);
+    kheap_trace_alloc(obj, cache->obj_size, __builtin_return_address(0));
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!obj) return;
+    kheap_trace_free(obj);
+    cache_free(cache, slab_of(obj), obj);
+}
+
+void kmem_cache_destroy(kmem_cache_t *cache) {
+    if (!cache) return;
+
+    // With every object back, each slab is a CPU slab or sits on the partial list
+    size_t live = 0;
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    for (size_t i = 0; i < MAX_CPUS; i++) {
+        slab_t *s = cache->cpu[i].current;
+        if (!s) continue;
+        take_remote(s, __atomic_exchange_n(&s->remote, NULL, __ATOMIC_ACQUIRE));
+        live += s->inuse;
+    }
+    for (slab_t *s = cache->partial; s; s = s->next) live += s->inuse;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (live) {
+        kprint(LOG_ERR, "SLAB: %s: destroyed with %zu objects in use, leaking it\n", cache->name, live);
+        return;
+    }
+
+    for (size_t i = 0; i < MAX_CPUS; i++) {
+        if (cache->cpu[i].current) pmm_free_pages(virt_to_phys(cache->cpu[i].current), SLAB_ORDER);
+    }
+    while (cache->partial) {
+        slab_t *s = cache->partial;
+        cache->partial = s->next;
+        pmm_free_pages(virt_to_phys(s), SLAB_ORDER);
+    }
+    cache_free(&cache_cache, slab_of(cache), cache);
+}
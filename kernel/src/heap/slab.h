@@ -0,0 +1,38 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* kmalloc size classes: powers of two from SLAB_MIN_SIZE to SLAB_MAX_SIZE */
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 2048
+
+/* Each slab is one naturally aligned buddy block, found from any object by masking */
+#define SLAB_ORDER 2
+#define SLAB_SIZE  (0x1000UL << SLAB_ORDER)
+
+void slab_init(void);
+
+/* O(1) allocation from the smallest class holding `size` (<= SLAB_MAX_SIZE) */
+void *slab_alloc(size_t size);
+void  slab_free(void *ptr);
+
+/* Object size of the class ptr was allocated from */
+size_t slab_usable(void *ptr);
+
+/*
+ * Typed object caches. `ctor` runs once on every object when its slab is
+ * created, not on each allocation, so objects must go back to the cache in
+ * their constructed state. An `align` of 0 means cache-line alignment.
+ */
+typedef struct slab_cache kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *));
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void  kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/* Release a cache and its slabs; every object must have been freed and no CPU may still use it */
+void  kmem_cache_destroy(kmem_cache_t *cache);
+
+#endif // SLAB_H
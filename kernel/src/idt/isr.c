@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include "printk.h"
 #include "io.h"
+#include "mmu/vmm.h"
 
 #define MAX_IRQS 16
 
@@ -81,6 +82,11 @@ uint64_t isr_common_frame(struct isr_frame *f) {
         return (uint64_t)f;
     }
 
+    // Page faults in lazily backed regions are resolved and retried
+    if (f->int_no == 14 && vmm_handle_fault(read_cr2(), f->err_code)) {
+        return (uint64_t)f;
+    }
+
     // EXCEPTION HANDLING
     const char *name = exc_name(f->int_no);
 
@@ -15,7 +15,9 @@
 #include "mmu/memmap.h"
 #include "mmu/pmm.h"
 #include "mmu/vmm.h"
+#include "mmu/vmalloc.h"
 #include "heap/kheap.h"
+#include "heap/kheap_trace.h"
 #include "vfs/file.h"
 #include "vfs/fs/ramfs/ramfs.h"
 #include "vfs/vfs.h"
@@ -128,17 +130,23 @@ void kmain(void) {
     kprint(LOG_INFO, "%s%s\n", (debug ? "debug-" : ""), KERNEL_VERSION_STRING);
 
     // Initialize systems
+    string_init();
     memmap_init(memmap_request.response);
     idt_init();
     pit_init(1000);
     __asm__ volatile("sti");
     pmm_init();
     vmm_init();
+    fb_enable_wc();
     kheap_init();
+    vmalloc_init();
     vfs_init();
     vfs_register_filesystem(&ramfs_fs);
     vfs_mount("ramfs", NULL, "/");
 
+    // Leak report over serial; empty unless built with KHEAP_TRACE=1
+    kheap_trace_report();
+
     kprint(LOG_WARN, "Halting on 3...\n");
     pit_sleep(1000);
     kprint(LOG_WARN, "Halting on 2...\n");
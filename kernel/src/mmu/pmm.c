@@ -3,17 +3,245 @@
 #include "memmap.h"
 #include "global.h"
 #include "printk.h"
+#include "spinlock.h"
+#include "cpu/cpu.h"
+#include "string.h"
 
 #define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+#define BITS_PER_WORD 64
 
-uint8_t *pmm_bitmap = NULL;
+/* One zone per usable memmap entry; the zone masks below are 64-bit */
+#define PMM_MAX_ZONES 64
+
+uint64_t *pmm_bitmap = NULL;
 size_t pmm_bitmap_size = 0;
-static uintptr_t managed_base = 0;
-static size_t total_pages = 0;
 
-#define BIT_SET(b, i)   ((b)[(i)/8] |=  (1 << ((i) % 8)))
-#define BIT_CLEAR(b, i) ((b)[(i)/8] &= ~(1 << ((i) % 8)))
-#define BIT_TEST(b, i)  ((b)[(i)/8] &   (1 << ((i) % 8)))
+/*
+ * Buddy free lists. Each free block stores its list node in its own first
+ * page (through the HHDM), so the allocator needs no metadata beyond the
+ * bitmap. Blocks are aligned on their size in *physical* frame numbers, so
+ * an order 9 block is a valid 2 MiB page.
+ *
+ * The bitmap stays the authoritative allocation state (1 = used). Because
+ * free buddies are always merged eagerly, an aligned order-k range whose
+ * bits are all clear is exactly one free block of order k, which is how
+ * pmm_free_pages() detects a free buddy.
+ */
+typedef struct free_block {
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
+
+/*
+ * Every usable memmap entry becomes a zone with its own slice of the
+ * bitmap and its own free lists. Buddies never cross a zone boundary.
+ */
+typedef struct zone {
+    uintptr_t base;
+    size_t pages;
+    uint64_t *bitmap;
+    free_block_t *free_lists[PMM_MAX_ORDER + 1];
+    size_t free_count[PMM_MAX_ORDER + 1];
+#ifdef PMM_DEBUG
+    uint64_t *cached;  /* 1 = freed page held in a magazine, the stash or the pool */
+#endif
+} zone_t;
+
+static zone_t zones[PMM_MAX_ZONES];
+static size_t zone_count = 0;
+
+/* Bit z set in zone_mask[o] <=> zones[z] has a free block of order o */
+static uint64_t zone_mask[PMM_MAX_ORDER + 1];
+
+/* Protects the zones; the per-CPU caches below only take it in batches */
+static spinlock_t zone_lock = SPINLOCK_INIT;
+
+/*
+ * Per-CPU magazines of single pages. pmm_alloc_page()/pmm_free_page() only
+ * touch the local magazine; when it runs dry it is refilled with
+ * PCP_BATCH pages under one zone_lock acquisition, and when it grows past
+ * PCP_HIGH it is drained back down to PCP_LOW the same way.
+ */
+#define PCP_BATCH 32
+#define PCP_LOW   64
+#define PCP_HIGH  256
+
+typedef struct pcp {
+    size_t count;
+    uintptr_t pages[PCP_HIGH];
+} __attribute__((aligned(CACHE_LINE_SIZE))) pcp_t;
+
+static pcp_t pcp[MAX_CPUS];
+
+/*
+ * Pre-zeroed pages for pmm_alloc_zeroed_page(). pmm_zero_idle() clears
+ * pages when the CPU has nothing better to do: first those drained out of
+ * the magazines into the dirty stash, then the local magazine's surplus,
+ * and only then fresh pages from the zones, up to ZERO_POOL_FILL. Both are
+ * a reserve, not a hoard: order-0 allocations fall back on them and a
+ * failing larger allocation returns them all to the zones so their buddies
+ * can merge again.
+ *
+ * Lock order: zero_lock may be held when taking zone_lock, never the reverse.
+ */
+#define ZERO_POOL_MAX  512
+#define ZERO_POOL_FILL 128  /* top-up from the zones stops here */
+#define DIRTY_MAX     256
+
+static spinlock_t zero_lock = SPINLOCK_INIT;
+static uintptr_t zero_pool[ZERO_POOL_MAX];
+static size_t zero_count = 0;
+static uintptr_t dirty_stash[DIRTY_MAX];
+static size_t dirty_count = 0;
+
+#define WORD_INDEX(i) ((i) / BITS_PER_WORD)
+
+/* Mask covering bits [start, start + count) of one word, count <= 64 */
+static inline uint64_t word_mask(size_t start, size_t count) {
+    uint64_t m = (count >= BITS_PER_WORD) ? ~0ull : ((1ull << count) - 1);
+    return m << start;
+}
+
+/* Set (used) or clear (free) a run of bits, a whole word at a time */
+static void bitmap_fill(uint64_t *bitmap, size_t i, size_t count, int used) {
+    while (count) {
+        size_t bit = i % BITS_PER_WORD;
+        size_t n = BITS_PER_WORD - bit;
+        if (n > count) n = count;
+
+        uint64_t m = word_mask(bit, n);
+        if (used) bitmap[WORD_INDEX(i)] |= m;
+        else      bitmap[WORD_INDEX(i)] &= ~m;
+
+        i += n;
+        count -= n;
+    }
+}
+
+/* Check that every bit of a run is clear (free) or set (used) */
+static int bitmap_all(const uint64_t *bitmap, size_t i, size_t count, int used) {
+    while (count) {
+        size_t bit = i % BITS_PER_WORD;
+        size_t n = BITS_PER_WORD - bit;
+        if (n > count) n = count;
+
+        uint64_t m = word_mask(bit, n);
+        uint64_t w = bitmap[WORD_INDEX(i)] & m;
+        if (used ? (w != m) : (w != 0)) return 0;
+
+        i += n;
+        count -= n;
+    }
+    return 1;
+}
+
+static inline size_t zone_id(zone_t *z) {
+    return (size_t)(z - zones);
+}
+
+static inline free_block_t *block_at(zone_t *z, size_t idx) {
+    return (free_block_t *)phys_to_virt(z->base + idx * PAGE_SIZE);
+}
+
+static inline size_t block_index(zone_t *z, free_block_t *b) {
+    return (virt_to_phys(b) - z->base) / PAGE_SIZE;
+}
+
+static void list_push(zone_t *z, unsigned int order, size_t idx) {
+    free_block_t *b = block_at(z, idx);
+    b->prev = NULL;
+    b->next = z->free_lists[order];
+    if (b->next) b->next->prev = b;
+    z->free_lists[order] = b;
+    if (z->free_count[order]++ == 0) zone_mask[order] |= 1ull << zone_id(z);
+}
+
+static void list_remove(zone_t *z, unsigned int order, free_block_t *b) {
+    if (b->prev) b->prev->next = b->next;
+    else z->free_lists[order] = b->next;
+    if (b->next) b->next->prev = b->prev;
+    if (--z->free_count[order] == 0) zone_mask[order] &= ~(1ull << zone_id(z));
+}
+
+/* Largest order a block starting at idx may have, by physical alignment */
+static unsigned int max_order_at(zone_t *z, size_t idx) {
+    uintptr_t pfn = (z->base >> PAGE_SHIFT) + idx;
+    unsigned int order = pfn ? (unsigned int)__builtin_ctzll(pfn) : PMM_MAX_ORDER;
+    return order > PMM_MAX_ORDER ? PMM_MAX_ORDER : order;
+}
+
+/* Zone containing phys, by binary search over the sorted zone bases */
+static zone_t *zone_of(uintptr_t phys) {
+    size_t lo = 0, hi = zone_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        zone_t *z = &zones[mid];
+        if (phys < z->base) hi = mid;
+        else if (phys >= z->base + z->pages * PAGE_SIZE) lo = mid + 1;
+        else return z;
+    }
+    return NULL;
+}
+
+#ifdef PMM_DEBUG
+/*
+ * Freed pages keep their bitmap bits set while they sit in a magazine, the
+ * dirty stash or the zero pool, so debug builds mark them in a second
+ * bitmap to catch a second free. Its words are shared between CPUs that
+ * hold no common lock, hence the atomics. Returns the previous mark.
+ */
+static int cache_mark(uintptr_t phys, int cached) {
+    zone_t *z = zone_of(phys);
+    if (!z) return 0;
+
+    size_t idx = (phys - z->base) / PAGE_SIZE;
+    uint64_t m = 1ull << (idx % BITS_PER_WORD);
+    uint64_t *w = &z->cached[WORD_INDEX(idx)];
+    uint64_t old = cached ? __atomic_fetch_or(w, m, __ATOMIC_RELAXED)
+                          : __atomic_fetch_and(w, ~m, __ATOMIC_RELAXED);
+    return (old & m) != 0;
+}
+#else
+static inline int cache_mark(uintptr_t phys, int cached) {
+    (void)phys; (void)cached;
+    return 0;
+}
+#endif
+
+/* Release an allocated block, merging with its buddy as far as possible */
+static void buddy_free(zone_t *z, size_t idx, unsigned int order) {
+    bitmap_fill(z->bitmap, idx, (size_t)1 << order, 0);
+
+    uintptr_t base_pfn = z->base >> PAGE_SHIFT;
+    while (order < PMM_MAX_ORDER) {
+        size_t buddy = ((base_pfn + idx) ^ ((uintptr_t)1 << order)) - base_pfn;
+        size_t span = (size_t)1 << order;
+
+        if (buddy >= z->pages || buddy + span > z->pages) break;
+        if (!bitmap_all(z->bitmap, buddy, span, 0)) break;
+
+        list_remove(z, order, block_at(z, buddy));
+        if (buddy < idx) idx = buddy;
+        order++;
+    }
+
+    list_push(z, order, idx);
+}
+
+/* Hand a run of pages to the free lists as maximal aligned blocks */
+static void free_run(zone_t *z, size_t idx, size_t count) {
+    while (count) {
+        unsigned int order = max_order_at(z, idx);
+        while (((size_t)1 << order) > count) order--;
+
+        bitmap_fill(z->bitmap, idx, (size_t)1 << order, 0);
+        list_push(z, order, idx);
+
+        idx += (size_t)1 << order;
+        count -= (size_t)1 << order;
+    }
+}
 
 void pmm_init(void) {
     struct limine_memmap_entry *big = memmap_find_biggest_region();
@@ -22,42 +250,340 @@ void pmm_init(void) {
         for (;;) asm("hlt");
     }
 
-    managed_base = big->base;
-    total_pages  = big->length / PAGE_SIZE;
-    pmm_bitmap_size  = (total_pages + 7) / 8;
+    // One zone per usable entry; Limine hands the entries out sorted
+    zone_count = 0;
+    size_t bitmap_words = 0;
+    for (uint64_t i = 0; i < g_memmap->entry_count; i++) {
+        struct limine_memmap_entry *e = g_memmap->entries[i];
+        if (e->type != LIMINE_MEMMAP_USABLE || e->length < PAGE_SIZE) continue;
 
-    // Place pmm_bitmap at start of that region via HHDM
-    pmm_bitmap = (uint8_t *)(g_hhdm_offset + managed_base);
+        if (zone_count == PMM_MAX_ZONES) {
+            kprint(LOG_WARN, "PMM: more than %u usable regions, ignoring the rest\n",
+                   (unsigned int)PMM_MAX_ZONES);
+            break;
+        }
 
-    // Mark all pages as used
-    for (size_t i = 0; i < pmm_bitmap_size; i++) {
-        pmm_bitmap[i] = 0xFF;
+        zone_t *z = &zones[zone_count++];
+        z->base  = e->base;
+        z->pages = e->length / PAGE_SIZE;
+        bitmap_words += (z->pages + BITS_PER_WORD - 1) / BITS_PER_WORD;
     }
 
-    // Free all pages after the pmm_bitmap itself
-    size_t used_pages = (pmm_bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (size_t i = used_pages; i < total_pages; i++) {
-        BIT_CLEAR(pmm_bitmap, i);
+    // All zone bitmaps live back to back at the start of the biggest region
+    pmm_bitmap_size = bitmap_words * sizeof(uint64_t);
+    pmm_bitmap = (uint64_t *)(g_hhdm_offset + big->base);
+    for (size_t w = 0; w < bitmap_words; w++) {
+        pmm_bitmap[w] = ~0ull; // used, including the tail bits of each zone
     }
-    if (debug) kprint(LOG_DEBUG, "Physical Memory Manager initialized\n");
+#ifdef PMM_DEBUG
+    // The cached marks follow, all clear
+    uint64_t *next_cached = pmm_bitmap + bitmap_words;
+    for (size_t w = 0; w < bitmap_words; w++) {
+        next_cached[w] = 0;
+    }
+    pmm_bitmap_size *= 2;
+#endif
+
+    for (unsigned int o = 0; o <= PMM_MAX_ORDER; o++) {
+        zone_mask[o] = 0;
+    }
+
+    uint64_t *next_bitmap = pmm_bitmap;
+    size_t total_free = 0;
+    for (size_t i = 0; i < zone_count; i++) {
+        zone_t *z = &zones[i];
+        z->bitmap = next_bitmap;
+        next_bitmap += (z->pages + BITS_PER_WORD - 1) / BITS_PER_WORD;
+#ifdef PMM_DEBUG
+        z->cached = next_cached;
+        next_cached += (z->pages + BITS_PER_WORD - 1) / BITS_PER_WORD;
+#endif
+
+        for (unsigned int o = 0; o <= PMM_MAX_ORDER; o++) {
+            z->free_lists[o] = NULL;
+            z->free_count[o] = 0;
+        }
+
+        // Keep the pages holding the bitmaps themselves
+        size_t first = 0;
+        if (z->base == big->base) {
+            first = (pmm_bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
+        }
+        if (first < z->pages) {
+            free_run(z, first, z->pages - first);
+            total_free += z->pages - first;
+        }
+    }
+
+    if (debug) kprint(LOG_DEBUG, "Physical Memory Manager initialized (%zu zones, %zu MiB free)\n",
+                      zone_count, total_free * PAGE_SIZE / (1024 * 1024));
+}
+
+static uintptr_t zone_alloc(unsigned int order) {
+
+    // First order with a free block anywhere, then the highest zone that has
+    // one, so low memory is the last to go
+    unsigned int o = order;
+    while (o <= PMM_MAX_ORDER && !zone_mask[o]) o++;
+    if (o > PMM_MAX_ORDER) return 0; // out of memory
+
+    zone_t *z = &zones[63 - __builtin_clzll(zone_mask[o])];
+    free_block_t *b = z->free_lists[o];
+    list_remove(z, o, b);
+    size_t idx = block_index(z, b);
+
+    // Split down, handing the upper halves back to the lower lists
+    while (o > order) {
+        o--;
+        list_push(z, o, idx + ((size_t)1 << o));
+    }
+
+    bitmap_fill(z->bitmap, idx, (size_t)1 << order, 1);
+    return z->base + idx * PAGE_SIZE; // physical
+}
+
+static void zone_free(uintptr_t phys_addr, unsigned int order) {
+    if (phys_addr & (((uintptr_t)PAGE_SIZE << order) - 1)) {
+        kprint(LOG_WARN, "PMM: misaligned free of %p (order %u)\n", (void *)phys_addr, order);
+        return;
+    }
+
+    zone_t *z = zone_of(phys_addr);
+    if (!z) return;
+
+    size_t idx = (phys_addr - z->base) / PAGE_SIZE;
+    size_t span = (size_t)1 << order;
+    if (idx + span > z->pages) return;
+
+    int used = bitmap_all(z->bitmap, idx, span, 1);
+#ifdef PMM_DEBUG
+    used = used && bitmap_all(z->cached, idx, span, 0);
+#endif
+    if (!used) {
+        kprint(LOG_WARN, "PMM: double free of %p (order %u)\n", (void *)phys_addr, order);
+        return;
+    }
+
+    buddy_free(z, idx, order);
+}
+
+/* Give a page held in a magazine, the stash or the pool back to its zone */
+static void cached_free(uintptr_t phys_addr) {
+    cache_mark(phys_addr, 0);
+    zone_free(phys_addr, 0);
+}
+
+/* Return the local magazine to the zones, e.g. before a large allocation fails */
+static void pcp_drain_local(void) {
+    uint64_t flags = irq_save();
+    pcp_t *c = &pcp[cpu_id()];
+
+    if (c->count) {
+        spin_lock(&zone_lock);
+        while (c->count) cached_free(c->pages[--c->count]);
+        spin_unlock(&zone_lock);
+    }
+    irq_restore(flags);
+}
+
+/* Last-resort single page from the dirty stash or the zeroed pool */
+static uintptr_t reserve_take(void) {
+    uint64_t flags = spin_lock_irqsave(&zero_lock);
+    uintptr_t phys = dirty_count ? dirty_stash[--dirty_count] :
+                     zero_count ? zero_pool[--zero_count] : 0;
+    spin_unlock_irqrestore(&zero_lock, flags);
+    return phys;
+}
+
+/* Give the stash and the pool back to the zones */
+static void reserve_drain(void) {
+    uint64_t flags = spin_lock_irqsave(&zero_lock);
+    if (dirty_count || zero_count) {
+        spin_lock(&zone_lock);
+        while (dirty_count) cached_free(dirty_stash[--dirty_count]);
+        while (zero_count) cached_free(zero_pool[--zero_count]);
+        spin_unlock(&zone_lock);
+    }
+    spin_unlock_irqrestore(&zero_lock, flags);
+}
+
+uintptr_t pmm_alloc_pages(unsigned int order) {
+    if (order > PMM_MAX_ORDER) return 0;
+
+    uint64_t flags = spin_lock_irqsave(&zone_lock);
+    uintptr_t phys = zone_alloc(order);
+    spin_unlock_irqrestore(&zone_lock, flags);
+
+    // Pages parked in our magazine or the zeroing reserve may be what keeps a buddy from merging
+    if (!phys) {
+        pcp_drain_local();
+        reserve_drain();
+        flags = spin_lock_irqsave(&zone_lock);
+        phys = zone_alloc(order);
+        spin_unlock_irqrestore(&zone_lock, flags);
+    }
+    return phys;
+}
+
+void pmm_free_pages(uintptr_t phys_addr, unsigned int order) {
+    if (order > PMM_MAX_ORDER) return;
+
+    uint64_t flags = spin_lock_irqsave(&zone_lock);
+    zone_free(phys_addr, order);
+    spin_unlock_irqrestore(&zone_lock, flags);
+}
+
+void pmm_free_range(uintptr_t phys_addr, size_t count) {
+    uint64_t flags = spin_lock_irqsave(&zone_lock);
+    while (count) {
+        uintptr_t pfn = phys_addr >> PAGE_SHIFT;
+        unsigned int order = pfn ? (unsigned int)__builtin_ctzll(pfn) : PMM_MAX_ORDER;
+        if (order > PMM_MAX_ORDER) order = PMM_MAX_ORDER;
+        while (((size_t)1 << order) > count) order--;
+
+        zone_free(phys_addr, order);
+        phys_addr += (uintptr_t)PAGE_SIZE << order;
+        count -= (size_t)1 << order;
+    }
+    spin_unlock_irqrestore(&zone_lock, flags);
 }
 
 uintptr_t pmm_alloc_page(void) {
-    for (size_t i = 0; i < total_pages; i++) {
-        if (!BIT_TEST(pmm_bitmap, i)) {
-            BIT_SET(pmm_bitmap, i);
-            return managed_base + i * PAGE_SIZE; // physical
+    uint64_t flags = irq_save();
+    pcp_t *c = &pcp[cpu_id()];
+
+    if (!c->count) {
+        spin_lock(&zone_lock);
+        while (c->count < PCP_BATCH) {
+            uintptr_t phys = zone_alloc(0);
+            if (!phys) break;
+            c->pages[c->count++] = phys;
         }
+        spin_unlock(&zone_lock);
     }
-    return 0; // out of memory
+
+    uintptr_t phys = c->count ? c->pages[--c->count] : reserve_take();
+    irq_restore(flags);
+    cache_mark(phys, 0);
+    return phys;
+}
+
+/*
+ * Magazines hand out whatever they hold, so keep foreign pages out of them.
+ * Double frees are only caught in PMM_DEBUG builds: checking the shared
+ * bitmap on every free would cost the cache-line traffic magazines avoid.
+ */
+static int free_page_ok(uintptr_t phys_addr) {
+    if (phys_addr & (PAGE_SIZE - 1)) {
+        kprint(LOG_WARN, "PMM: misaligned free of %p (order 0)\n", (void *)phys_addr);
+        return 0;
+    }
+
+    zone_t *z = zone_of(phys_addr);
+    if (!z) {
+        kprint(LOG_WARN, "PMM: free of unmanaged page %p\n", (void *)phys_addr);
+        return 0;
+    }
+
+#ifdef PMM_DEBUG
+    size_t idx = (phys_addr - z->base) / PAGE_SIZE;
+    uint64_t flags = spin_lock_irqsave(&zone_lock);
+    int used = bitmap_all(z->bitmap, idx, 1, 1);
+    spin_unlock_irqrestore(&zone_lock, flags);
+
+    if (!used || cache_mark(phys_addr, 1)) {
+        kprint(LOG_WARN, "PMM: double free of %p (order 0)\n", (void *)phys_addr);
+        return 0;
+    }
+#endif
+    return 1;
 }
 
 void pmm_free_page(uintptr_t phys_addr) {
-    if (phys_addr < managed_base) return;
-    size_t i = (phys_addr - managed_base) / PAGE_SIZE;
-    if (i < total_pages) {
-        BIT_CLEAR(pmm_bitmap, i);
+    if (!phys_addr || !free_page_ok(phys_addr)) return;
+
+    uint64_t flags = irq_save();
+    pcp_t *c = &pcp[cpu_id()];
+
+    if (c->count == PCP_HIGH) {
+        spin_lock(&zero_lock);
+        while (c->count > PCP_LOW && dirty_count < DIRTY_MAX)
+            dirty_stash[dirty_count++] = c->pages[--c->count];
+        spin_unlock(&zero_lock);
+
+        if (c->count > PCP_LOW) {
+            spin_lock(&zone_lock);
+            while (c->count > PCP_LOW) cached_free(c->pages[--c->count]);
+            spin_unlock(&zone_lock);
+        }
+    }
+
+    c->pages[c->count++] = phys_addr;
+    irq_restore(flags);
+}
+
+uintptr_t pmm_alloc_zeroed_page(void) {
+    uint64_t flags = spin_lock_irqsave(&zero_lock);
+    uintptr_t phys = zero_count ? zero_pool[--zero_count] : 0;
+    spin_unlock_irqrestore(&zero_lock, flags);
+    if (phys) {
+        cache_mark(phys, 0);
+        return phys;
+    }
+
+    // Pool ran dry, clear one synchronously
+    phys = pmm_alloc_page();
+    if (phys) memset(phys_to_virt(phys), 0, PAGE_SIZE);
+    return phys;
+}
+
+size_t pmm_zero_idle(size_t budget) {
+    size_t done = 0;
+
+    while (done < budget) {
+        uint64_t flags = spin_lock_irqsave(&zero_lock);
+        if (zero_count >= ZERO_POOL_MAX) {
+            spin_unlock_irqrestore(&zero_lock, flags);
+            break;
+        }
+        uintptr_t phys = dirty_count ? dirty_stash[--dirty_count] : 0;
+        int top_up = zero_count < ZERO_POOL_FILL;
+        spin_unlock_irqrestore(&zero_lock, flags);
+
+        // Then pages freed into our magazine, leaving it a batch for fast allocations
+        if (!phys) {
+            flags = irq_save();
+            pcp_t *c = &pcp[cpu_id()];
+            if (c->count > PCP_BATCH) phys = c->pages[--c->count];
+            irq_restore(flags);
+        }
+
+        // Boot and steady growth free little, so take fresh pages up to the watermark
+        if (!phys && top_up) {
+            flags = spin_lock_irqsave(&zone_lock);
+            phys = zone_alloc(0);
+            spin_unlock_irqrestore(&zone_lock, flags);
+        }
+        if (!phys) break;
+
+        // Zero with interrupts on, only the pool push is serialized
+        memset(phys_to_virt(phys), 0, PAGE_SIZE);
+
+        flags = spin_lock_irqsave(&zero_lock);
+        if (zero_count < ZERO_POOL_MAX) {
+            zero_pool[zero_count++] = phys;
+            phys = 0;
+        }
+        spin_unlock_irqrestore(&zero_lock, flags);
+
+        if (phys) {
+            cache_mark(phys, 0);
+            pmm_free_page(phys);
+            break;
+        }
+        done++;
     }
+    return done;
 }
 
 /* Helper to map phys -> virt */
@@ -4,13 +4,38 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Largest buddy block is 2^PMM_MAX_ORDER pages (4 MiB) */
+#define PMM_MAX_ORDER 10
+
 void pmm_init(void);
 uintptr_t pmm_alloc_page(void);
 void pmm_free_page(uintptr_t phys_addr);
 void *pmm_alloc_page_hhdm(void);
 
+/* Allocate 2^order physically contiguous pages, aligned on their size */
+uintptr_t pmm_alloc_pages(unsigned int order);
+
+/* Free a block previously returned by pmm_alloc_pages() with the same order */
+void pmm_free_pages(uintptr_t phys_addr, unsigned int order);
+
+/* Free an arbitrary run of allocated pages, e.g. the unused tail of a block */
+void pmm_free_range(uintptr_t phys_addr, size_t count);
+
+/* Allocate a page that is already cleared, from the pool pmm_zero_idle() fills */
+uintptr_t pmm_alloc_zeroed_page(void);
+
+/* Zero up to `budget` freed pages into the pool; call from idle loops */
+size_t pmm_zero_idle(size_t budget);
+
+/* Smallest order whose block holds at least `count` pages */
+static inline unsigned int pmm_order_for(size_t count) {
+    unsigned int order = 0;
+    while (((size_t)1 << order) < count) order++;
+    return order;
+}
+
 /* expose bitmap info so VMM can map it */
-extern uint8_t *pmm_bitmap;
+extern uint64_t *pmm_bitmap;
 extern size_t pmm_bitmap_size;
 
 #endif // PMM_H
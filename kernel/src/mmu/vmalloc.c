@@ -0,0 +1,322 @@
+#include "vmalloc.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "kprint.h"
+#include "global.h"
+#include "spinlock.h"
+#include "heap/kheap.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Free and allocated ranges of the vmalloc area live in two AVL trees keyed
+ * by start address. Nodes of the free tree also carry the largest range in
+ * their subtree, so the lowest fitting range is found in one descent.
+ */
+typedef struct vmap_area {
+    uintptr_t start;
+    uintptr_t end;
+    struct vmap_area *left;
+    struct vmap_area *right;
+    int height;
+    size_t max_size;
+} vmap_area_t;
+
+static vmap_area_t *free_root = NULL;
+static vmap_area_t *busy_root = NULL;
+static spinlock_t vmap_lock = SPINLOCK_INIT;
+
+static inline int height(vmap_area_t *n) {
+    return n ? n->height : 0;
+}
+
+static inline size_t max_size(vmap_area_t *n) {
+    return n ? n->max_size : 0;
+}
+
+static void update(vmap_area_t *n) {
+    int hl = height(n->left), hr = height(n->right);
+    n->height = 1 + (hl > hr ? hl : hr);
+
+    size_t m = n->end - n->start;
+    if (max_size(n->left) > m) m = max_size(n->left);
+    if (max_size(n->right) > m) m = max_size(n->right);
+    n->max_size = m;
+}
+
+static vmap_area_t *rotate_right(vmap_area_t *y) {
+    vmap_area_t *x = y->left;
+    y->left = x->right;
+    x->right = y;
+    update(y);
+    update(x);
+    return x;
+}
+
+static vmap_area_t *rotate_left(vmap_area_t *x) {
+    vmap_area_t *y = x->right;
+    x->right = y->left;
+    y->left = x;
+    update(x);
+    update(y);
+    return y;
+}
+
+static vmap_area_t *balance(vmap_area_t *n) {
+    update(n);
+    int bf = height(n->left) - height(n->right);
+
+    if (bf > 1) {
+        if (height(n->left->left) < height(n->left->right))
+            n->left = rotate_left(n->left);
+        return rotate_right(n);
+    }
+    if (bf < -1) {
+        if (height(n->right->right) < height(n->right->left))
+            n->right = rotate_right(n->right);
+        return rotate_left(n);
+    }
+    return n;
+}
+
+static vmap_area_t *tree_insert(vmap_area_t *root, vmap_area_t *node) {
+    if (!root) {
+        node->left = node->right = NULL;
+        update(node);
+        return node;
+    }
+    if (node->start < root->start)
+        root->left = tree_insert(root->left, node);
+    else
+        root->right = tree_insert(root->right, node);
+    return balance(root);
+}
+
+static vmap_area_t *remove_min(vmap_area_t *n, vmap_area_t **min) {
+    if (!n->left) {
+        *min = n;
+        return n->right;
+    }
+    n->left = remove_min(n->left, min);
+    return balance(n);
+}
+
+/* Unlink the node starting at `start`; *out is NULL if there is none */
+static vmap_area_t *tree_remove(vmap_area_t *root, uintptr_t start, vmap_area_t **out) {
+    if (!root) return NULL;
+
+    if (start < root->start) {
+        root->left = tree_remove(root->left, start, out);
+    } else if (start > root->start) {
+        root->right = tree_remove(root->right, start, out);
+    } else {
+        *out = root;
+        if (!root->right) return root->left;
+        vmap_area_t *m;
+        vmap_area_t *right = remove_min(root->right, &m);
+        m->left = root->left;
+        m->right = right;
+        return balance(m);
+    }
+    return balance(root);
+}
+
+/* Lowest-addressed free range of at least `size` bytes */
+static vmap_area_t *find_fit(vmap_area_t *n, size_t size) {
+    while (n) {
+        if (max_size(n->left) >= size)
+            n = n->left;
+        else if (n->end - n->start >= size)
+            return n;
+        else if (max_size(n->right) >= size)
+            n = n->right;
+        else
+            return NULL;
+    }
+    return NULL;
+}
+
+/* Free range ending exactly at `addr`, and the one starting exactly there */
+static vmap_area_t *find_ending_at(vmap_area_t *n, uintptr_t addr) {
+    while (n) {
+        if (n->end == addr) return n;
+        n = (addr <= n->start) ? n->left : n->right;
+    }
+    return NULL;
+}
+
+static vmap_area_t *find_starting_at(vmap_area_t *n, uintptr_t addr) {
+    while (n && n->start != addr) {
+        n = (addr < n->start) ? n->left : n->right;
+    }
+    return n;
+}
+
+void vmalloc_init(void) {
+    vmap_area_t *all = kmalloc(sizeof(vmap_area_t));
+    if (!all) {
+        kprint(LOG_ERR, "VMALLOC: no memory for the range index\n");
+        return;
+    }
+    all->start = VMALLOC_START;
+    all->end = VMALLOC_END;
+    free_root = tree_insert(NULL, all);
+    if (debug) kprint(LOG_DEBUG, "VMALLOC: area at %p\n", (void *)VMALLOC_START);
+}
+
+uintptr_t vmalloc_range(size_t size) {
+    if (!size) return 0;
+    size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    size += PAGE_SIZE; // guard page
+
+    // Splitting a free range needs a node; allocate it before taking the lock
+    vmap_area_t *spare = kmalloc(sizeof(vmap_area_t));
+    if (!spare) return 0;
+
+    uint64_t flags = spin_lock_irqsave(&vmap_lock);
+    vmap_area_t *fit = find_fit(free_root, size);
+    if (!fit) {
+        spin_unlock_irqrestore(&vmap_lock, flags);
+        kfree(spare);
+        kprint(LOG_ERR, "VMALLOC: out of virtual space for %zu bytes\n", size);
+        return 0;
+    }
+
+    vmap_area_t *busy;
+    uintptr_t start = fit->start;
+    free_root = tree_remove(free_root, start, &fit);
+    if (fit->end - fit->start == size) {
+        busy = fit;
+    } else {
+        fit->start += size;
+        free_root = tree_insert(free_root, fit);
+        busy = spare;
+        spare = NULL;
+        busy->start = start;
+        busy->end = start + size;
+    }
+    busy_root = tree_insert(busy_root, busy);
+    spin_unlock_irqrestore(&vmap_lock, flags);
+
+    if (spare) kfree(spare);
+    return start;
+}
+
+/* Move an allocated range back into the free tree, merging with its neighbours */
+static void release_area(vmap_area_t *va) {
+    vmap_area_t *merged[2] = { NULL, NULL };
+
+    uint64_t flags = spin_lock_irqsave(&vmap_lock);
+    vmap_area_t *prev = find_ending_at(free_root, va->start);
+    if (prev) {
+        free_root = tree_remove(free_root, prev->start, &merged[0]);
+        va->start = prev->start;
+    }
+    vmap_area_t *next = find_starting_at(free_root, va->end);
+    if (next) {
+        free_root = tree_remove(free_root, next->start, &merged[1]);
+        va->end = next->end;
+    }
+    free_root = tree_insert(free_root, va);
+    spin_unlock_irqrestore(&vmap_lock, flags);
+
+    if (merged[0]) kfree(merged[0]);
+    if (merged[1]) kfree(merged[1]);
+}
+
+static vmap_area_t *take_busy(uintptr_t start) {
+    vmap_area_t *va = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&vmap_lock);
+    busy_root = tree_remove(busy_root, start, &va);
+    spin_unlock_irqrestore(&vmap_lock, flags);
+
+    if (!va) kprint(LOG_ERR, "VMALLOC: free of unknown range %p\n", (void *)start);
+    return va;
+}
+
+void vfree_range(uintptr_t start) {
+    vmap_area_t *va = take_busy(start);
+    if (va) release_area(va);
+}
+
+/* Back [start + from, start + to) with fresh pages; returns false, with the new pages unmapped, on OOM */
+static bool populate(uintptr_t start, size_t from, size_t to, int zero) {
+    for (size_t off = from; off < to; off += PAGE_SIZE) {
+        uintptr_t phys = zero ? pmm_alloc_zeroed_page() : pmm_alloc_page();
+        if (!phys) {
+            kprint(LOG_ERR, "VMALLOC: out of memory for %zu bytes\n", to);
+            vmm_unmap_range_free(start + from, off - from);
+            return false;
+        }
+        vmm_map(start + off, phys, VMM_WRITE);
+    }
+    return true;
+}
+
+static void *vmalloc_pages(size_t size, int zero) {
+    uintptr_t start = vmalloc_range(size);
+    if (!start) return NULL;
+
+    size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    if (!populate(start, 0, size, zero)) {
+        vfree_range(start);
+        return NULL;
+    }
+    return (void *)start;
+}
+
+void *vmalloc(size_t size) {
+    return vmalloc_pages(size, 0);
+}
+
+/* Pages come from the PMM's pre-zeroed pool where possible */
+void *vzalloc(size_t size) {
+    return vmalloc_pages(size, 1);
+}
+
+size_t vmalloc_size(const void *addr) {
+    uint64_t flags = spin_lock_irqsave(&vmap_lock);
+    vmap_area_t *va = find_starting_at(busy_root, (uintptr_t)addr);
+    size_t size = va ? va->end - va->start - PAGE_SIZE : 0;
+    spin_unlock_irqrestore(&vmap_lock, flags);
+    return size;
+}
+
+void *vrealloc(void *addr, size_t size) {
+    if (!addr) return vmalloc(size);
+
+    size_t old = vmalloc_size(addr);
+    if (size <= old) return addr;
+
+    uintptr_t start = vmalloc_range(size);
+    if (!start) return NULL;
+    size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+
+    // Move the old frames over instead of copying their contents
+    for (size_t off = 0; off < old; off += PAGE_SIZE) {
+        vmm_map(start + off, vmm_resolve((uintptr_t)addr + off), VMM_WRITE);
+    }
+    if (!populate(start, old, size, 0)) {
+        vmm_unmap_range(start, old);
+        vfree_range(start);
+        return NULL;
+    }
+
+    vmm_unmap_range((uintptr_t)addr, old);
+    vfree_range((uintptr_t)addr);
+    return (void *)start;
+}
+
+void vfree(void *addr) {
+    if (!addr) return;
+
+    vmap_area_t *va = take_busy((uintptr_t)addr);
+    if (!va) return;
+
+    // Everything but the guard page is mapped; frames go back after the flush
+    vmm_unmap_range_free(va->start, va->end - va->start - PAGE_SIZE);
+    release_area(va);
+}
@@ -0,0 +1,39 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Kernel virtual range handed out by the vmalloc allocator */
+#define VMALLOC_START 0xFFFFA00000000000ULL
+#define VMALLOC_END   0xFFFFB00000000000ULL
+
+/* Set up the free-range index; needs kmalloc */
+void vmalloc_init(void);
+
+/*
+ * Reserve `size` bytes (rounded up to pages) of kernel virtual space with
+ * an unmapped guard page after it. Nothing is mapped. Returns 0 on failure.
+ */
+uintptr_t vmalloc_range(size_t size);
+
+/* Give back a range from vmalloc_range(); the caller has unmapped it */
+void vfree_range(uintptr_t start);
+
+/* Virtually contiguous, page-aligned memory backed by individual PMM pages */
+void *vmalloc(size_t size);
+void *vzalloc(size_t size);
+void vfree(void *addr);
+
+/* Mapped size of a vmalloc() allocation, 0 if addr is not one */
+size_t vmalloc_size(const void *addr);
+
+/* Grow by remapping the existing frames into a bigger range; no copying */
+void *vrealloc(void *addr, size_t size);
+
+static inline bool is_vmalloc_addr(const void *addr) {
+    return (uintptr_t)addr >= VMALLOC_START && (uintptr_t)addr < VMALLOC_END;
+}
+
+#endif // VMALLOC_H
@@ -2,6 +2,9 @@
 #include "kprint.h"
 #include "pmm.h"
 #include "global.h"
+#include "cpu/cpu.h"
+#include "spinlock.h"
+#include "heap/kheap.h"
 
 #include <string.h>
 #include <stdint.h>
@@ -15,7 +18,88 @@
 #define PD_INDEX(x) (((x) >> 21) & 0x1FF)
 #define PT_INDEX(x) (((x) >> 12) & 0x1FF)
 
-static uintptr_t current_pml4 = 0;
+/* Index into the table at `level`: 4 = PML4, 3 = PDPT, 2 = PD, 1 = PT */
+#define LEVEL_INDEX(x, level) (((x) >> (12 + 9 * ((level) - 1))) & 0x1FF)
+
+#define SIZE_2M 0x200000ULL
+#define SIZE_1G 0x40000000ULL
+#define PAGE_MASK_2M 0x000FFFFFFFE00000ULL
+#define PAGE_MASK_1G 0x000FFFFFC0000000ULL
+
+/*
+ * Non-leaf entries keep the number of present entries in the table they
+ * point to in their ignored bits 52-61. Kernel-half PML4 entries are
+ * copied into every space, so PDPT counts are only kept in the lower half.
+ */
+#define COUNT_SHIFT 52
+#define COUNT_MASK (0x3FFull << COUNT_SHIFT)
+
+/* Ignored bit 11 of a non-leaf entry: its table is the bootloader's, not the PMM's */
+#define TABLE_BOOT (1ull << 11)
+
+/* PAT bit in 2 MiB / 1 GiB entries; in 4 KiB entries it sits where VMM_HUGE is */
+#define VMM_PAT_LARGE (1ull << 12)
+#define VMM_PAT_4K VMM_HUGE
+
+/*
+ * PAT layout: PA0-PA5 as the bootloader leaves them (WB, WT, UC-, UC, WP,
+ * WC), PA6/PA7 pinned to UC- and UC. VMM_WC selects PA5: PAT + PWT.
+ */
+#define PAT_VALUE 0x0007010500070406ULL
+
+#define CR3_NOFLUSH (1ull << 63)
+#define MAX_PCID 4096
+
+static vmm_space_t kernel_space = { 0 };
+static vmm_space_t *current_space = &kernel_space;
+static int has_1g_pages = 0;
+
+/* Every space except the kernel one, for sharing new kernel PML4 entries */
+static spinlock_t space_lock = SPINLOCK_INIT;
+static vmm_space_t *space_list = NULL;
+
+/* Lazily backed ranges registered with vmm_reserve_region() */
+#define MAX_FAULT_REGIONS 16
+
+typedef struct fault_region {
+    uintptr_t start;
+    uintptr_t end;
+    uint64_t flags;
+    vmm_fault_policy_t policy;
+} fault_region_t;
+
+/* Guards the region table and serializes backing faulted pages */
+static spinlock_t fault_lock = SPINLOCK_INIT;
+static fault_region_t fault_regions[MAX_FAULT_REGIONS];
+static size_t fault_region_count = 0;
+
+static int pge_enabled = 0;
+static int pat_enabled = 0;
+static int pcid_enabled = 0;
+static uint64_t pcid_used[MAX_PCID / 64];
+/* Last space that ran with PCID 0; any other PCID 0 user must flush */
+static vmm_space_t *pcid0_owner = &kernel_space;
+
+/* PTEs of the fixmap window, KMAP_SLOTS per CPU, and each CPU's slot depth */
+static uint64_t *fixmap_ptes = NULL;
+static size_t kmap_depth[MAX_CPUS];
+_Static_assert(MAX_CPUS * KMAP_SLOTS <= ENTRIES_PER_TABLE, "fixmap must fit one page table");
+
+/*
+ * Direct-mapped cache of last-level page tables for the current space,
+ * keyed by the 2 MiB window (virt >> 21, plus one so zero means empty).
+ * Large pages are never cached. Emptied on space switch; a slot is dropped
+ * when its page table is unlinked.
+ */
+#define TCACHE_ENTRIES 16
+
+typedef struct tcache_entry {
+    uintptr_t tag;
+    uint64_t *pt;
+    uint64_t *pde;   /* entry pointing at pt, for its population count */
+} tcache_entry_t;
+
+static volatile tcache_entry_t tcache[TCACHE_ENTRIES];
 
 static inline void *p2v(uintptr_t phys) {
     return (void *)(g_hhdm_offset + phys);
@@ -31,102 +115,786 @@ static inline void invlpg(uintptr_t addr) {
     asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
 }
 
+/*
+ * Hardware bits for a 4 KiB leaf. Kernel-half leaves are global so they
+ * survive CR3 reloads and PCID switches. Without PAT, VMM_WC falls back
+ * to UC- (PCD), which a WC MTRR over the range still turns into WC; never
+ * to write-back, which is wrong for device memory.
+ */
+static inline uint64_t leaf_flags(uintptr_t virt, uint64_t flags) {
+    if (flags & VMM_WC) {
+        flags &= ~VMM_WC;
+        if (pat_enabled) flags = (flags & ~VMM_CACHE_DIS) | VMM_PAT_4K | VMM_WRITE_THR;
+        else flags |= VMM_CACHE_DIS;
+    }
+    return virt >= KERNEL_HALF_BASE ? flags | VMM_GLOBAL : flags;
+}
+
+/* Flush the whole TLB, global entries and every PCID included */
+static void flush_all_global(void) {
+    if (!pge_enabled) {
+        asm volatile("mov %0, %%cr3" :: "r"(read_cr3()) : "memory");
+        return;
+    }
+    uint64_t flags = irq_save();
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+    irq_restore(flags);
+}
+
+/*
+ * Without PGE a kernel-half change is only flushed from the current PCID,
+ * so the other spaces have to drop theirs on their next switch. Global
+ * entries are dropped from all PCIDs by invlpg and by a PGE toggle.
+ */
+static void stale_other_spaces(uintptr_t virt) {
+    if (!pcid_enabled || pge_enabled || virt < KERNEL_HALF_BASE) return;
+
+    uint64_t flags = spin_lock_irqsave(&space_lock);
+    if (current_space != &kernel_space) kernel_space.needs_flush = true;
+    for (vmm_space_t *s = space_list; s; s = s->next) {
+        if (s != current_space) s->needs_flush = true;
+    }
+    spin_unlock_irqrestore(&space_lock, flags);
+}
+
+static void flush_page(uintptr_t virt) {
+    invlpg(virt);
+    stale_other_spaces(virt);
+}
+
+/* Past this many pages a CR3 reload is cheaper than one invlpg per page */
+#define FLUSH_MAX_INVLPG 32
+
+void vmm_flush_global(uintptr_t virt, size_t size) {
+    uintptr_t start = virt & ~(uintptr_t)(PAGE_SIZE - 1);
+    uintptr_t end = virt + size;
+
+    stale_other_spaces(start);
+    if ((end - start) / PAGE_SIZE > FLUSH_MAX_INVLPG) {
+        flush_all_global();
+        return;
+    }
+    for (uintptr_t va = start; va < end; va += PAGE_SIZE) {
+        invlpg(va);
+    }
+}
+
+/* Flush [start, end) from the TLB after a batch of PTE updates */
+static void flush_range(uintptr_t start, uintptr_t end) {
+    if (start >= KERNEL_HALF_BASE) {
+        vmm_flush_global(start, end - start);
+        return;
+    }
+    if ((end - start) / PAGE_SIZE > FLUSH_MAX_INVLPG) {
+        // Reload whatever is live; during vmm_init that is not the new PML4
+        asm volatile("mov %0, %%cr3" :: "r"(read_cr3()) : "memory");
+        return;
+    }
+    for (uintptr_t va = start; va < end; va += PAGE_SIZE) {
+        invlpg(va);
+    }
+}
+
+/*
+ * The page fault handler can refill a slot under us, so the tag is read
+ * on both sides of the table pointer and must match both times.
+ */
+static uint64_t *tcache_lookup(uintptr_t virt, uint64_t **pde) {
+    uintptr_t key = (virt >> 21) + 1;
+    volatile tcache_entry_t *e = &tcache[(virt >> 21) % TCACHE_ENTRIES];
+    if (e->tag != key) return NULL;
+    uint64_t *pt = e->pt;
+    uint64_t *parent = e->pde;
+    if (e->tag != key) return NULL;
+    if (pde) *pde = parent;
+    return pt;
+}
+
+static void tcache_fill(uintptr_t virt, uint64_t *pt, uint64_t *pde) {
+    volatile tcache_entry_t *e = &tcache[(virt >> 21) % TCACHE_ENTRIES];
+    e->tag = 0;
+    e->pt = pt;
+    e->pde = pde;
+    e->tag = (virt >> 21) + 1;
+}
+
+static void tcache_drop(uintptr_t virt) {
+    volatile tcache_entry_t *e = &tcache[(virt >> 21) % TCACHE_ENTRIES];
+    if (e->tag == (virt >> 21) + 1) e->tag = 0;
+}
+
+static void tcache_flush(void) {
+    for (size_t i = 0; i < TCACHE_ENTRIES; i++) {
+        tcache[i].tag = 0;
+    }
+}
+
 static uintptr_t alloc_table(void) {
-    uintptr_t phys = pmm_alloc_page();
+    uintptr_t phys = pmm_alloc_zeroed_page();
     if (!phys) {
         kprint(LOG_ERR, "VMM: out of memory for page tables!\n");
         for (;;) asm("hlt");
     }
-    memset(p2v(phys), 0, PAGE_SIZE);
     return phys;
 }
 
-static uint64_t *walk(uintptr_t virt, int create) {
-    uint64_t *pml4 = (uint64_t *)p2v(current_pml4);
+/*
+ * Replace a 1 GiB or 2 MiB entry by a table of 512 entries one level down
+ * that map the same range with the same attributes. The translations do
+ * not change, so no TLB flush is needed.
+ */
+static void split_large(uint64_t *entry, int level) {
+    uint64_t e = *entry;
+    uintptr_t table = alloc_table();
+    uint64_t *t = (uint64_t *)p2v(table);
 
-    uint64_t *pml4e = &pml4[PML4_INDEX(virt)];
-    if (!(*pml4e & VMM_PRESENT)) {
-        if (!create) return NULL;
-        uintptr_t new = alloc_table();
-        *pml4e = (new & PAGE_MASK) | VMM_PRESENT | VMM_WRITE;
+    if (level == 3) {
+        uintptr_t phys = e & PAGE_MASK_1G;
+        uint64_t flags = e & ~PAGE_MASK_1G;
+        for (size_t i = 0; i < ENTRIES_PER_TABLE; i++) {
+            t[i] = (phys + i * SIZE_2M) | flags;
+        }
+    } else {
+        uintptr_t phys = e & PAGE_MASK_2M;
+        uint64_t flags = e & ~PAGE_MASK_2M & ~(VMM_HUGE | VMM_PAT_LARGE);
+        if (e & VMM_PAT_LARGE) flags |= VMM_HUGE; // bit 7 is PAT in a 4 KiB entry
+        for (size_t i = 0; i < ENTRIES_PER_TABLE; i++) {
+            t[i] = (phys + i * PAGE_SIZE) | flags;
+        }
     }
-    uint64_t *pdpt = (uint64_t *)p2v((*pml4e) & PAGE_MASK);
 
-    uint64_t *pdpte = &pdpt[PDPT_INDEX(virt)];
-    if (!(*pdpte & VMM_PRESENT)) {
-        if (!create) return NULL;
-        uintptr_t new = alloc_table();
-        *pdpte = (new & PAGE_MASK) | VMM_PRESENT | VMM_WRITE;
+    *entry = (table & PAGE_MASK) | VMM_PRESENT | VMM_WRITE | (e & VMM_USER) |
+             ((uint64_t)ENTRIES_PER_TABLE << COUNT_SHIFT);
+}
+
+static inline unsigned table_count(uint64_t entry) {
+    return (unsigned)((entry & COUNT_MASK) >> COUNT_SHIFT);
+}
+
+/*
+ * Adjust the count of the table at `level`, kept in `parent` which points at it.
+ * kmap() stores fixmap PTEs directly, so the fixmap table is not counted either.
+ */
+static void count_add(uint64_t *parent, int level, uintptr_t virt, int delta) {
+    if (!parent || level >= 4 || (level == 3 && virt >= KERNEL_HALF_BASE)) return;
+    if (level == 1 && virt >= FIXMAP_BASE) return;
+    if (delta >= 0)
+        *parent += (uint64_t)delta << COUNT_SHIFT;
+    else
+        *parent -= (uint64_t)-delta << COUNT_SHIFT;
+}
+
+/* Copy a new kernel-half PML4 entry into every space so the half stays shared */
+static void share_kernel_entry(size_t idx, uint64_t entry) {
+    uint64_t flags = spin_lock_irqsave(&space_lock);
+    ((uint64_t *)p2v(kernel_space.pml4))[idx] = entry;
+    for (vmm_space_t *s = space_list; s; s = s->next) {
+        ((uint64_t *)p2v(s->pml4))[idx] = entry;
     }
-    uint64_t *pd = (uint64_t *)p2v((*pdpte) & PAGE_MASK);
+    spin_unlock_irqrestore(&space_lock, flags);
+}
+
+/*
+ * Return the entry for virt in the table at `level`, creating missing
+ * tables when asked. Large pages found on the way are split, since the
+ * caller wants a finer-grained entry. If `path` is given, path[l] is set
+ * to the entry used at each level l above `level`.
+ */
+static uint64_t *walk_level(uintptr_t virt, int level, int create, uint64_t **path) {
+    uint64_t *table = (uint64_t *)p2v(current_space->pml4);
+    uint64_t *parent = NULL;
 
-    uint64_t *pde = &pd[PD_INDEX(virt)];
-    if (!(*pde & VMM_PRESENT)) {
-        if (!create) return NULL;
-        uintptr_t new = alloc_table();
-        *pde = (new & PAGE_MASK) | VMM_PRESENT | VMM_WRITE;
+    for (int l = 4; l > level; l--) {
+        uint64_t *e = &table[LEVEL_INDEX(virt, l)];
+
+        if (!(*e & VMM_PRESENT)) {
+            if (!create) return NULL;
+            uintptr_t new = alloc_table();
+            *e = (new & PAGE_MASK) | VMM_PRESENT | VMM_WRITE;
+            count_add(parent, l, virt, 1);
+            if (l == 4 && virt >= KERNEL_HALF_BASE)
+                share_kernel_entry(LEVEL_INDEX(virt, 4), *e);
+        } else if (l < 4 && (*e & VMM_HUGE)) {
+            split_large(e, l);
+        }
+        if (path) path[l] = e;
+        parent = e;
+        table = (uint64_t *)p2v((*e) & PAGE_MASK);
+    }
+
+    return &table[LEVEL_INDEX(virt, level)];
+}
+
+/* PTE for virt; `pde` (may be NULL) receives the entry holding its table's count */
+static uint64_t *walk(uintptr_t virt, int create, uint64_t **pde) {
+    uint64_t *pt = tcache_lookup(virt, pde);
+    if (pt) return &pt[PT_INDEX(virt)];
+
+    uint64_t *path[5];
+    uint64_t *pte = walk_level(virt, 1, create, path);
+    if (!pte) return NULL;
+    tcache_fill(virt, pte - PT_INDEX(virt), path[2]);
+    if (pde) *pde = path[2];
+    return pte;
+}
+
+/*
+ * Try to map one 1 GiB or 2 MiB page at virt. Spots that already hold a
+ * page table are left alone so the caller falls back to smaller pages.
+ */
+static size_t map_one_large(uintptr_t virt, uintptr_t phys, size_t len, uint64_t flags) {
+    uint64_t large_flags = leaf_flags(virt, flags);
+    if (large_flags & VMM_PAT_4K) large_flags ^= VMM_PAT_4K | VMM_PAT_LARGE;
+    large_flags |= VMM_PRESENT | VMM_HUGE;
+
+    uint64_t *path[5];
+
+    if (has_1g_pages && !(virt & (SIZE_1G - 1)) && !(phys & (SIZE_1G - 1)) && len >= SIZE_1G) {
+        uint64_t *pdpte = walk_level(virt, 3, 1, path);
+        if (!(*pdpte & VMM_PRESENT) || (*pdpte & VMM_HUGE)) {
+            if (!(*pdpte & VMM_PRESENT)) count_add(path[4], 3, virt, 1);
+            *pdpte = (phys & PAGE_MASK_1G) | large_flags;
+            return SIZE_1G;
+        }
+    }
+
+    if (!(virt & (SIZE_2M - 1)) && !(phys & (SIZE_2M - 1)) && len >= SIZE_2M) {
+        uint64_t *pde = walk_level(virt, 2, 1, path);
+        if (!(*pde & VMM_PRESENT) || (*pde & VMM_HUGE)) {
+            if (!(*pde & VMM_PRESENT)) count_add(path[3], 2, virt, 1);
+            *pde = (phys & PAGE_MASK_2M) | large_flags;
+            return SIZE_2M;
+        }
     }
-    uint64_t *pt = (uint64_t *)p2v((*pde) & PAGE_MASK);
 
-    return &pt[PT_INDEX(virt)];
+    return 0;
 }
 
 void vmm_map(uintptr_t virt, uintptr_t phys, uint64_t flags) {
-    uint64_t *pte = walk(virt, 1);
-    *pte = (phys & PAGE_MASK) | flags | VMM_PRESENT;
-    invlpg(virt);
+    uint64_t *pde;
+    uint64_t *pte = walk(virt, 1, &pde);
+    uint64_t old = *pte;
+    *pte = (phys & PAGE_MASK) | leaf_flags(virt, flags) | VMM_PRESENT;
+    // Not-present entries are never cached, so only a replacement needs a flush
+    if (old & VMM_PRESENT)
+        flush_page(virt);
+    else
+        count_add(pde, 1, virt, 1);
 }
 
 void vmm_unmap(uintptr_t virt) {
-    uint64_t *pte = walk(virt, 0);
-    if (pte && (*pte & VMM_PRESENT)) {
-        *pte = 0;
-        invlpg(virt);
+    vmm_unmap_range(virt & ~(uintptr_t)(PAGE_SIZE - 1), PAGE_SIZE);
+}
+
+void vmm_map_range(uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags) {
+    int allow_large = (flags & VMM_HUGE) != 0;
+    int replaced = 0;
+    flags = leaf_flags(virt, flags & ~VMM_HUGE);
+
+    uintptr_t start = virt & ~(uintptr_t)(PAGE_SIZE - 1);
+    uintptr_t end = (virt + size + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    virt = start;
+    phys &= PAGE_MASK;
+
+    while (virt < end) {
+        if (allow_large) {
+            size_t done = map_one_large(virt, phys, end - virt, flags);
+            if (done) {
+                virt += done;
+                phys += done;
+                continue;
+            }
+        }
+
+        // One walk per page table, then fill PTEs up to its end
+        uint64_t *pde;
+        uint64_t *pte = walk(virt, 1, &pde);
+        uintptr_t table_start = virt;
+        size_t idx = PT_INDEX(virt);
+        int added = 0;
+        do {
+            if (*pte & VMM_PRESENT) replaced = 1;
+            else added++;
+            *pte++ = (phys & PAGE_MASK) | flags | VMM_PRESENT;
+            virt += PAGE_SIZE;
+            phys += PAGE_SIZE;
+        } while (++idx < ENTRIES_PER_TABLE && virt < end);
+        count_add(pde, 1, table_start, added);
+    }
+
+    // Large pages are only placed over empty or large entries; flush those
+    // conservatively, fresh 4 KiB entries need no flush at all
+    if (replaced || allow_large) flush_range(start, end);
+}
+
+/* Tables unlinked by vmm_unmap_range(), freed once the TLB no longer sees them */
+#define RECLAIM_BATCH 32
+
+/* Unmapped frames to free, chained through the frames themselves via the HHDM */
+typedef struct frame_link {
+    uintptr_t next;
+    size_t pages;
+} frame_link_t;
+
+typedef struct reclaim {
+    uintptr_t tables[RECLAIM_BATCH];
+    size_t count;
+    bool kernel;       /* a kernel-half table, possibly cached under other PCIDs */
+    bool free_frames;  /* also hand the unmapped frames back to the PMM */
+    uintptr_t frames;  /* head of the frame_link_t chain, 0 if empty */
+} reclaim_t;
+
+static void reclaim_frame(reclaim_t *rc, uint64_t entry, uintptr_t mask, size_t pages) {
+    if (!rc->free_frames) return;
+    uintptr_t phys = entry & mask;
+    frame_link_t *link = (frame_link_t *)p2v(phys);
+    link->next = rc->frames;
+    link->pages = pages;
+    rc->frames = phys;
+}
+
+static void reclaim_flush(reclaim_t *rc, uintptr_t start, uintptr_t end) {
+    if (rc->kernel && pcid_enabled) {
+        // invlpg only drops paging-structure caches of the current PCID
+        stale_other_spaces(start);
+        flush_all_global();
+    } else {
+        flush_range(start, end);
+    }
+    for (size_t i = 0; i < rc->count; i++) {
+        pmm_free_page(rc->tables[i]);
+    }
+    while (rc->frames) {
+        frame_link_t *link = (frame_link_t *)p2v(rc->frames);
+        uintptr_t phys = rc->frames;
+        size_t pages = link->pages;
+        rc->frames = link->next;
+        if (pages == 1) pmm_free_page(phys);
+        else pmm_free_range(phys, pages);
+    }
+    rc->count = 0;
+    rc->kernel = false;
+}
+
+/*
+ * The table at `level` just lost entries. Unlink it if it is now empty,
+ * then go on with its parent. Kernel-half PDPTs are shared by every space
+ * and stay, as do the uncounted fixmap table and the bootloader's tables.
+ */
+static void release_empty(uint64_t **path, int level, uintptr_t virt, reclaim_t *rc) {
+    for (; level <= 3; level++) {
+        uint64_t *ref = path[level + 1];
+        if (level == 3 && virt >= KERNEL_HALF_BASE) return;
+        if (level == 1 && virt >= FIXMAP_BASE) return;
+        if (table_count(*ref) || (*ref & TABLE_BOOT)) return;
+
+        if (level == 1) tcache_drop(virt);
+        rc->tables[rc->count++] = *ref & PAGE_MASK;
+        rc->kernel |= virt >= KERNEL_HALF_BASE;
+        *ref = 0;
+        if (level < 3) count_add(path[level + 2], level + 1, virt, -1);
+    }
+}
+
+/*
+ * Ranges may end at the very top of the address space (the fixmap), where
+ * an end address wraps to 0, so progress is kept as the bytes still left.
+ */
+static void unmap_range(uintptr_t virt, size_t size, bool free_frames) {
+    uintptr_t start = virt & ~(uintptr_t)(PAGE_SIZE - 1);
+    size_t left = ((virt & (PAGE_SIZE - 1)) + size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    uintptr_t flushed = start;
+    reclaim_t rc = { .count = 0, .kernel = false, .free_frames = free_frames, .frames = 0 };
+    virt = start;
+
+    while (left) {
+        size_t to_1g = SIZE_1G - (virt & (SIZE_1G - 1));
+        size_t to_2m = SIZE_2M - (virt & (SIZE_2M - 1));
+        if (to_1g > left) to_1g = left;
+        if (to_2m > left) to_2m = left;
+        uint64_t *path[5];
+
+        // Up to three tables can be unlinked per step; keep room for them
+        if (rc.count > RECLAIM_BATCH - 3) {
+            reclaim_flush(&rc, flushed, virt);
+            flushed = virt;
+        }
+
+        uint64_t *pdpte = walk_level(virt, 3, 0, path);
+        if (!pdpte || !(*pdpte & VMM_PRESENT)) {
+            virt += to_1g;
+            left -= to_1g;
+            continue;
+        }
+        if ((*pdpte & VMM_HUGE) && to_1g == SIZE_1G) {
+            reclaim_frame(&rc, *pdpte, PAGE_MASK_1G, SIZE_1G / PAGE_SIZE);
+            *pdpte = 0;
+            count_add(path[4], 3, virt, -1);
+            release_empty(path, 3, virt, &rc);
+            virt += to_1g;
+            left -= to_1g;
+            continue;
+        }
+
+        uint64_t *pde = walk_level(virt, 2, 0, path);
+        if (!(*pde & VMM_PRESENT)) {
+            virt += to_2m;
+            left -= to_2m;
+            continue;
+        }
+        if ((*pde & VMM_HUGE) && to_2m == SIZE_2M) {
+            reclaim_frame(&rc, *pde, PAGE_MASK_2M, SIZE_2M / PAGE_SIZE);
+            *pde = 0;
+            count_add(path[3], 2, virt, -1);
+            release_empty(path, 2, virt, &rc);
+            virt += to_2m;
+            left -= to_2m;
+            continue;
+        }
+
+        uint64_t *pte = walk_level(virt, 1, 0, path);
+        uintptr_t table_start = virt;
+        size_t idx = PT_INDEX(virt);
+        int cleared = 0;
+        do {
+            if (*pte & VMM_PRESENT) {
+                reclaim_frame(&rc, *pte, PAGE_MASK, 1);
+                cleared++;
+            }
+            *pte++ = 0;
+            virt += PAGE_SIZE;
+            left -= PAGE_SIZE;
+        } while (++idx < ENTRIES_PER_TABLE && left);
+        count_add(path[2], 1, table_start, -cleared);
+        release_empty(path, 1, table_start, &rc);
     }
+
+    // virt may have wrapped to 0; the flush only uses the distance from `flushed`
+    reclaim_flush(&rc, flushed, virt);
+}
+
+void vmm_unmap_range(uintptr_t virt, size_t size) {
+    unmap_range(virt, size, false);
+}
+
+void vmm_unmap_range_free(uintptr_t virt, size_t size) {
+    unmap_range(virt, size, true);
 }
 
 uintptr_t vmm_resolve(uintptr_t virt) {
-    uint64_t *pte = walk(virt, 0);
-    if (!pte || !(*pte & VMM_PRESENT)) return 0;
-    return ((*pte) & PAGE_MASK) | (virt & (PAGE_SIZE - 1));
+    uint64_t *table = tcache_lookup(virt, NULL);
+    if (table) {
+        uint64_t e = table[PT_INDEX(virt)];
+        return (e & VMM_PRESENT) ? (e & PAGE_MASK) | (virt & (PAGE_SIZE - 1)) : 0;
+    }
+
+    table = (uint64_t *)p2v(current_space->pml4);
+    uint64_t *pde = NULL;
+
+    for (int l = 4; l >= 1; l--) {
+        uint64_t e = table[LEVEL_INDEX(virt, l)];
+        if (!(e & VMM_PRESENT)) return 0;
+        if (l == 2) pde = &table[LEVEL_INDEX(virt, l)];
+
+        if (l == 3 && (e & VMM_HUGE))
+            return (e & PAGE_MASK_1G) | (virt & (SIZE_1G - 1));
+        if (l == 2 && (e & VMM_HUGE))
+            return (e & PAGE_MASK_2M) | (virt & (SIZE_2M - 1));
+        if (l == 1) {
+            tcache_fill(virt, table, pde);
+            return (e & PAGE_MASK) | (virt & (PAGE_SIZE - 1));
+        }
+
+        table = (uint64_t *)p2v(e & PAGE_MASK);
+    }
+    return 0;
+}
+
+int vmm_reserve_region(uintptr_t start, uintptr_t end, uint64_t flags, vmm_fault_policy_t policy) {
+    if (start >= end) return -1;
+
+    uint64_t irq = spin_lock_irqsave(&fault_lock);
+    if (fault_region_count == MAX_FAULT_REGIONS) {
+        spin_unlock_irqrestore(&fault_lock, irq);
+        return -1;
+    }
+    fault_region_t *r = &fault_regions[fault_region_count++];
+    r->start = start & ~(uintptr_t)(PAGE_SIZE - 1);
+    r->end = end;
+    r->flags = flags & ~VMM_HUGE;
+    r->policy = policy;
+    spin_unlock_irqrestore(&fault_lock, irq);
+    return 0;
+}
+
+bool vmm_handle_fault(uintptr_t addr, uint64_t err_code) {
+    // Only not-present faults can be resolved by backing the page
+    if (err_code & 1) return false;
+
+    uint64_t flags = spin_lock_irqsave(&fault_lock);
+    fault_region_t *r = NULL;
+    for (size_t i = 0; i < fault_region_count; i++) {
+        if (addr >= fault_regions[i].start && addr < fault_regions[i].end) {
+            r = &fault_regions[i];
+            break;
+        }
+    }
+    // User-mode accesses (U/S set in the error code) only get user regions backed
+    if (!r || r->policy == VMM_FAULT_GUARD || ((err_code & 4) && !(r->flags & VMM_USER))) {
+        spin_unlock_irqrestore(&fault_lock, flags);
+        return false;
+    }
+
+    uintptr_t page = addr & ~(uintptr_t)(PAGE_SIZE - 1);
+    uint64_t *pde;
+    uint64_t *pte = walk(page, 1, &pde);
+    if (!pte || (*pte & VMM_PRESENT)) {
+        // No table to back it in, or another CPU backed it first
+        spin_unlock_irqrestore(&fault_lock, flags);
+        return pte != NULL;
+    }
+
+    uintptr_t phys = (r->policy == VMM_FAULT_ZERO) ? pmm_alloc_zeroed_page() : pmm_alloc_page();
+    if (phys) {
+        // The entry was not present, so there is nothing to flush
+        *pte = (phys & PAGE_MASK) | leaf_flags(page, r->flags) | VMM_PRESENT;
+        count_add(pde, 1, page, 1);
+    }
+    spin_unlock_irqrestore(&fault_lock, flags);
+
+    if (!phys) kprint(LOG_ERR, "VMM: out of memory backing %p\n", (void *)addr);
+    return phys != 0;
+}
+
+void *kmap(uintptr_t phys, uint64_t flags) {
+    uint32_t cpu = cpu_id();
+    // An interrupt in between takes and releases its own slot before we resume
+    size_t slot = kmap_depth[cpu]++;
+    if (slot >= KMAP_SLOTS) {
+        kprint(LOG_ERR, "VMM: kmap slots exhausted on CPU %u\n", cpu);
+        for (;;) asm("hlt");
+    }
+
+    size_t idx = (size_t)cpu * KMAP_SLOTS + slot;
+    uintptr_t virt = FIXMAP_BASE + idx * PAGE_SIZE;
+    fixmap_ptes[idx] = (phys & PAGE_MASK) | leaf_flags(virt, flags) | VMM_PRESENT;
+    // Global, so this drops the slot's old translation from every PCID
+    invlpg(virt);
+    return (void *)(virt + (phys & (PAGE_SIZE - 1)));
+}
+
+void kunmap(void *virt) {
+    uint32_t cpu = cpu_id();
+    uintptr_t page = (uintptr_t)virt & ~(uintptr_t)(PAGE_SIZE - 1);
+    size_t idx = (page - FIXMAP_BASE) / PAGE_SIZE;
+    // Slots are a stack: only the most recent one may go
+    size_t depth = kmap_depth[cpu];
+    if (page < FIXMAP_BASE || !depth || idx != (size_t)cpu * KMAP_SLOTS + depth - 1) {
+        kprint(LOG_ERR, "VMM: kunmap of %p out of order on CPU %u\n", virt, cpu);
+        for (;;) asm("hlt");
+    }
+
+    fixmap_ptes[idx] = 0;
+    invlpg(page);
+    kmap_depth[cpu] = depth - 1;
 }
 
 void vmm_load_cr3(uintptr_t phys_addr) {
-    current_pml4 = phys_addr & PAGE_MASK;
-    asm volatile("mov %0, %%cr3" :: "r"(current_pml4) : "memory");
+    kernel_space.pml4 = phys_addr & PAGE_MASK;
+    current_space = &kernel_space;
+    pcid0_owner = &kernel_space;
+    tcache_flush();
+    asm volatile("mov %0, %%cr3" :: "r"(kernel_space.pml4) : "memory");
+}
+
+vmm_space_t *vmm_kernel_space(void) {
+    return &kernel_space;
+}
+
+vmm_space_t *vmm_current_space(void) {
+    return current_space;
+}
+
+static uint16_t pcid_alloc(void) {
+    if (!pcid_enabled) return 0;
+    for (size_t w = 0; w < MAX_PCID / 64; w++) {
+        if (~pcid_used[w]) {
+            size_t bit = (size_t)__builtin_ctzll(~pcid_used[w]);
+            pcid_used[w] |= 1ull << bit;
+            return (uint16_t)(w * 64 + bit);
+        }
+    }
+    return 0; // exhausted, share PCID 0 and flush on every switch
+}
+
+static void pcid_free(uint16_t pcid) {
+    if (pcid) pcid_used[pcid / 64] &= ~(1ull << (pcid % 64));
+}
+
+vmm_space_t *vmm_space_create(void) {
+    vmm_space_t *space = kmalloc(sizeof(vmm_space_t));
+    if (!space) return NULL;
+
+    space->pml4 = alloc_table();
+    space->needs_flush = true; // the PCID may still hold a previous owner's entries
+
+    uint64_t flags = spin_lock_irqsave(&space_lock);
+    uint64_t *kernel_pml4 = (uint64_t *)p2v(kernel_space.pml4);
+    uint64_t *pml4 = (uint64_t *)p2v(space->pml4);
+    for (size_t i = 256; i < ENTRIES_PER_TABLE; i++) {
+        pml4[i] = kernel_pml4[i];
+    }
+    space->pcid = pcid_alloc();
+    space->next = space_list;
+    space_list = space;
+    spin_unlock_irqrestore(&space_lock, flags);
+
+    return space;
+}
+
+/* Free the page tables below a lower-half entry; mapped frames stay with their owners */
+static void free_tables(uint64_t entry, int level) {
+    uint64_t *table = (uint64_t *)p2v(entry & PAGE_MASK);
+
+    if (level > 2) {
+        for (size_t i = 0; i < ENTRIES_PER_TABLE; i++) {
+            uint64_t e = table[i];
+            if ((e & VMM_PRESENT) && !(e & VMM_HUGE)) free_tables(e, level - 1);
+        }
+    } else if (level == 2) {
+        for (size_t i = 0; i < ENTRIES_PER_TABLE; i++) {
+            uint64_t e = table[i];
+            if ((e & VMM_PRESENT) && !(e & VMM_HUGE)) pmm_free_page(e & PAGE_MASK);
+        }
+    }
+    pmm_free_page(entry & PAGE_MASK);
+}
+
+void vmm_space_destroy(vmm_space_t *space) {
+    if (!space || space == &kernel_space || space == current_space) return;
+
+    uint64_t flags = spin_lock_irqsave(&space_lock);
+    for (vmm_space_t **pp = &space_list; *pp; pp = &(*pp)->next) {
+        if (*pp == space) {
+            *pp = space->next;
+            break;
+        }
+    }
+    pcid_free(space->pcid);
+    if (pcid0_owner == space) pcid0_owner = NULL;
+    spin_unlock_irqrestore(&space_lock, flags);
+
+    uint64_t *pml4 = (uint64_t *)p2v(space->pml4);
+    for (size_t i = 0; i < 256; i++) {
+        if (pml4[i] & VMM_PRESENT) free_tables(pml4[i], 3);
+    }
+    pmm_free_page(space->pml4);
+    kfree(space);
+}
+
+void vmm_space_switch(vmm_space_t *space) {
+    uint64_t flags = irq_save();
+    uint64_t cr3 = space->pml4;
+
+    if (pcid_enabled) {
+        bool flush = space->needs_flush || (space->pcid == 0 && pcid0_owner != space);
+        cr3 |= space->pcid;
+        if (!flush) cr3 |= CR3_NOFLUSH;
+        space->needs_flush = false;
+        if (space->pcid == 0) pcid0_owner = space;
+    }
+
+    current_space = space;
+    tcache_flush();
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    irq_restore(flags);
+}
+
+/*
+ * Set the global bit on every leaf below a kernel-half entry the bootloader
+ * built, and record each table's population count in the entry above it,
+ * marking the table as the bootloader's so it is never freed.
+ * Returns the count of `table`.
+ */
+static unsigned adopt_boot_table(uint64_t *table, int level) {
+    unsigned present = 0;
+
+    for (size_t i = 0; i < ENTRIES_PER_TABLE; i++) {
+        uint64_t e = table[i];
+        if (!(e & VMM_PRESENT)) continue;
+        present++;
+
+        if (level == 1 || (e & VMM_HUGE)) {
+            table[i] = e | VMM_GLOBAL;
+        } else {
+            unsigned n = adopt_boot_table((uint64_t *)p2v(e & PAGE_MASK), level - 1);
+            table[i] = (e & ~COUNT_MASK) | ((uint64_t)n << COUNT_SHIFT) | TABLE_BOOT;
+        }
+    }
+    return present;
 }
 
 void vmm_init(void) {
     const uintptr_t old_cr3_phys = read_cr3() & PAGE_MASK;
     uint64_t *old_pml4 = (uint64_t *)p2v(old_cr3_phys);
 
-    current_pml4 = alloc_table();
-    uint64_t *new_pml4 = (uint64_t *)p2v(current_pml4);
+    kernel_space.pml4 = alloc_table();
+    uint64_t *new_pml4 = (uint64_t *)p2v(kernel_space.pml4);
 
     for (size_t i = 256; i < ENTRIES_PER_TABLE; ++i) {
         new_pml4[i] = old_pml4[i];
+        if (new_pml4[i] & VMM_PRESENT)
+            adopt_boot_table((uint64_t *)p2v(new_pml4[i] & PAGE_MASK), 3);
     }
 
+    uint32_t a, b, c, d;
+    if (cpuid_max(0x80000001) >= 0x80000001) {
+        cpuid(0x80000001, 0, &a, &b, &c, &d);
+        has_1g_pages = (d >> 26) & 1;
+    }
+
+    // Identity map usable RAM with the largest pages that fit. The PMM
+    // bitmap lives inside a usable region, so this covers it as well.
     for (uint64_t i = 0; i < g_memmap->entry_count; i++) {
         struct limine_memmap_entry *e = g_memmap->entries[i];
         if (e->type != LIMINE_MEMMAP_USABLE) continue;
 
-        uintptr_t end = e->base + e->length;
-        for (uintptr_t addr = e->base; addr < end; addr += PAGE_SIZE) {
-            vmm_map(addr, addr, VMM_WRITE);
-        }
+        vmm_map_range(e->base, e->base, e->length, VMM_WRITE | VMM_HUGE);
     }
 
-    extern uint8_t *pmm_bitmap;
-    extern size_t pmm_bitmap_size;
+    // Every slot shares one page table, so kmap() never has to walk.
+    // The table is left out of population counts and is never reclaimed.
+    fixmap_ptes = walk(FIXMAP_BASE, 1, NULL);
 
-    if (pmm_bitmap && pmm_bitmap_size) {
-        uintptr_t bitmap_phys = virt_to_phys(pmm_bitmap);
-        for (size_t i = 0; i < pmm_bitmap_size; i += PAGE_SIZE) {
-            vmm_map(bitmap_phys + i, bitmap_phys + i, VMM_WRITE);
-        }
+    vmm_load_cr3(kernel_space.pml4);
+
+    cpuid(1, 0, &a, &b, &c, &d);
+    if ((d >> 13) & 1) {
+        write_cr4(read_cr4() | CR4_PGE);
+        pge_enabled = 1;
+    }
+
+    // Caches may hold lines under the old types; flush them around the switch
+    if ((d >> 16) & 1) {
+        uint64_t flags = irq_save();
+        wbinvd();
+        wrmsr(MSR_PAT, PAT_VALUE);
+        wbinvd();
+        flush_all_global();
+        irq_restore(flags);
+        pat_enabled = 1;
+    }
+
+    // CR4.PCIDE may only be set while CR3 carries PCID 0, which it does now
+    if ((c >> 17) & 1) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+        pcid_used[0] = 1; // PCID 0 belongs to the kernel space
+        pcid_enabled = 1;
     }
 
-    vmm_load_cr3(current_pml4);
-    if (debug) kprint(LOG_DEBUG, "Virtual Memory Manager initialized\n");
+    if (debug) kprint(LOG_DEBUG, "Virtual Memory Manager initialized%s%s%s\n",
+                      pge_enabled ? " (PGE)" : "", pcid_enabled ? " (PCID)" : "",
+                      pat_enabled ? " (PAT)" : "");
 }
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 /* Page size */
 #define PAGE_SIZE 0x1000
@@ -19,6 +20,31 @@
 #define VMM_GLOBAL (1ull << 8)
 #define VMM_NX (1ull << 63)
 
+/* Software flag: map write-combining. The VMM turns it into a PAT index, or UC- without PAT */
+#define VMM_WC (1ull << 9)
+
+/* First address of the kernel half, shared by every address space */
+#define KERNEL_HALF_BASE 0xFFFF800000000000ULL
+
+/*
+ * An address space: its own PML4 whose upper half is shared with the
+ * kernel space. With PCID support each space gets its own PCID so
+ * switching between spaces keeps their TLB entries.
+ */
+typedef struct vmm_space {
+    uintptr_t pml4;           /* physical address of the PML4 */
+    uint16_t pcid;            /* 0 when PCIDs are off or exhausted */
+    bool needs_flush;         /* TLB may hold stale entries for this PCID */
+    struct vmm_space *next;
+} vmm_space_t;
+
+/* What a page fault inside a reserved region does */
+typedef enum {
+    VMM_FAULT_GUARD,   /* never backed; a touch is a bug and gets dumped */
+    VMM_FAULT_ZERO,    /* back with a zero-filled page on first touch */
+    VMM_FAULT_ANY,     /* back with any free page, contents undefined */
+} vmm_fault_policy_t;
+
 /* Init new page tables and switch to them */
 void vmm_init(void);
 
@@ -28,19 +54,67 @@ void vmm_map(uintptr_t virt, uintptr_t phys, uint64_t flags);
 /* Unmap a single 4 KiB page */
 void vmm_unmap(uintptr_t virt);
 
+/*
+ * Map a physically contiguous range with one walk per page table and a
+ * single TLB flush at the end. With VMM_HUGE in flags, aligned parts of
+ * the range use 2 MiB / 1 GiB pages.
+ */
+void vmm_map_range(uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags);
+
+/* Unmap a range, flushing the TLB once at the end; tables left empty are freed after it */
+void vmm_unmap_range(uintptr_t virt, size_t size);
+
+/* Same, and return the frames that backed the range to the PMM after the flush */
+void vmm_unmap_range_free(uintptr_t virt, size_t size);
+
+/*
+ * Drop kernel-half translations for [virt, virt + size) from every PCID.
+ * Kernel mappings are global, so a CR3 reload alone does not flush them.
+ */
+void vmm_flush_global(uintptr_t virt, size_t size);
+
 /* Resolve virtual -> physical (0 if not mapped) */
 uintptr_t vmm_resolve(uintptr_t virt);
 
 /* Switch CR3 to a new PML4 (phys address) */
 void vmm_load_cr3(uintptr_t phys_addr);
 
-#define MAP_PHYS_PAGE_TO(virt, phys) \
-    vmm_map((virt), (phys) & ~0xFFFUL, VMM_PRESENT | VMM_WRITE); \
-    asm volatile("invlpg (%0)" :: "r" ((void*)(virt)) : "memory")
-#define MAP_ONE_STRUCT(type, virt, phys) \
-    ({ MAP_PHYS_PAGE_TO(virt, phys); (type*)((virt) + ((phys) & 0xFFFUL)); })
-#define UNMAP_ONE_STRUCT(virt) \
-    vmm_unmap((uintptr_t)(virt) & ~0xFFFUL); \
-    asm volatile("invlpg (%0)" :: "r" ((void*)((uintptr_t)(virt) & ~0xFFFUL)) : "memory")
+/* The space vmm_init() builds, holding the kernel half and identity map */
+vmm_space_t *vmm_kernel_space(void);
+vmm_space_t *vmm_current_space(void);
+
+/* New space with an empty lower half and the shared kernel half */
+vmm_space_t *vmm_space_create(void);
+
+/* Free a space's lower-half page tables and its PCID; must not be current */
+void vmm_space_destroy(vmm_space_t *space);
+
+/* Make `space` current; vmm_map() and friends then operate on it */
+void vmm_space_switch(vmm_space_t *space);
+
+/*
+ * Reserve [start, end) of kernel virtual space to be backed lazily: the
+ * first touch of each page faults and is resolved per `policy`, mapping
+ * the new page with `flags`.
+ */
+int vmm_reserve_region(uintptr_t start, uintptr_t end, uint64_t flags, vmm_fault_policy_t policy);
+
+/* Page-fault hook; returns true if the fault was resolved and can be retried */
+bool vmm_handle_fault(uintptr_t addr, uint64_t err_code);
+
+/*
+ * Per-CPU temporary mappings in the top 2 MiB of the address space. The
+ * page table behind it is allocated by vmm_init(), so kmap() is a single
+ * PTE store plus a local invlpg. Slots nest like a stack: kunmap() in the
+ * reverse order of kmap(). Only the page holding `phys` is mapped.
+ */
+#define FIXMAP_BASE 0xFFFFFFFFFFE00000ULL
+#define KMAP_SLOTS 8
+
+void *kmap(uintptr_t phys, uint64_t flags);
+void kunmap(void *virt);
+
+#define MAP_ONE_STRUCT(type, phys) ((type *)kmap((phys), VMM_WRITE))
+#define UNMAP_ONE_STRUCT(ptr) kunmap((void *)(ptr))
 
 #endif // VMM_H
@@ -3,6 +3,8 @@
 #include "io.h"
 #include "idt/isr.h"
 #include "kprint.h"
+#include "mmu/pmm.h"
+#include "heap/kheap.h"
 
 #define PIT_CHANNEL0_PORT 0x40
 #define PIT_COMMAND_PORT  0x43
@@ -36,6 +38,7 @@ uint64_t pit_get_ticks(void) {
 void pit_sleep(uint64_t ms) {
     uint64_t target = pit_ticks + (ms * 1000 / 1000); // sleepy weepy
     while (pit_ticks < target) {
-        __asm__ volatile ("pause");
+        // Idle time: pre-zero a page for the PMM or trim the heap, then spin as before
+        if (!pmm_zero_idle(1) && !kheap_trim_idle()) __asm__ volatile ("pause");
     }
 }
@@ -1,6 +1,8 @@
 #include "string.h"
 #include "io.h"
 
+#include <stdint.h>
+
 /* ----------------- String functions ----------------- */
 size_t strlen(const char *s) {
     size_t len = 0;
@@ -81,31 +83,93 @@ char *strstr(const char *haystack, const char *needle) {
 }
 
 /* ----------------- Memory functions ----------------- */
-void *memset(void *s, int c, size_t n) {
+/*
+ * Word-at-a-time versions. Stores are aligned first; where unaligned loads
+ * would trap or crawl, words are only used when the source lines up too.
+ */
+typedef unsigned long __attribute__((may_alias)) word_t;
+#define WORD_SIZE sizeof(word_t)
+#define WORD_MASK (WORD_SIZE - 1)
+
+#if defined(__x86_64__)
+/* Unaligned loads are cheap, so any source can be read by words */
+typedef unsigned long __attribute__((may_alias, aligned(1))) src_word_t;
+#define WORDS_LINE_UP(d, s) 1
+#else
+typedef word_t src_word_t;
+#define WORDS_LINE_UP(d, s) ((((uintptr_t)(d) ^ (uintptr_t)(s)) & WORD_MASK) == 0)
+#endif
+
+void *memset_words(void *s, int c, size_t n) {
     unsigned char *p = s;
+    while (n && ((uintptr_t)p & WORD_MASK)) {
+        *p++ = (unsigned char)c;
+        n--;
+    }
+
+    word_t w = (unsigned char)c * (~(word_t)0 / 0xFF);
+    for (; n >= WORD_SIZE; n -= WORD_SIZE, p += WORD_SIZE) *(word_t *)p = w;
+
     while (n--) *p++ = (unsigned char)c;
     return s;
 }
 
-void *memcpy(void *dest, const void *src, size_t n) {
+void *memcpy_words(void *dest, const void *src, size_t n) {
     unsigned char *d = dest;
     const unsigned char *s = src;
+
+    if (WORDS_LINE_UP(d, s)) {
+        while (n && ((uintptr_t)d & WORD_MASK)) {
+            *d++ = *s++;
+            n--;
+        }
+        for (; n >= WORD_SIZE; n -= WORD_SIZE, d += WORD_SIZE, s += WORD_SIZE)
+            *(word_t *)d = *(const src_word_t *)s;
+    }
+
     while (n--) *d++ = *s++;
     return dest;
 }
 
-void *memmove(void *dest, const void *src, size_t n) {
+/* A forward copy is safe whenever dest is below src */
+void *memmove_words(void *dest, const void *src, size_t n) {
     unsigned char *d = dest;
     const unsigned char *s = src;
-    if (d < s) {
-        while (n--) *d++ = *s++;
-    } else {
-        d += n; s += n;
-        while (n--) *--d = *--s;
+    if ((uintptr_t)d - (uintptr_t)s >= n) return memcpy_words(dest, src, n);
+
+    d += n; s += n;
+    if (WORDS_LINE_UP(d, s)) {
+        while (n && ((uintptr_t)d & WORD_MASK)) {
+            *--d = *--s;
+            n--;
+        }
+        for (; n >= WORD_SIZE; n -= WORD_SIZE) {
+            d -= WORD_SIZE; s -= WORD_SIZE;
+            *(word_t *)d = *(const src_word_t *)s;
+        }
     }
+
+    while (n--) *--d = *--s;
     return dest;
 }
 
+/* Architectures with faster versions provide these in src/arch */
+#if !defined(__x86_64__)
+void string_init(void) {}
+
+void *memset(void *s, int c, size_t n) {
+    return memset_words(s, c, n);
+}
+
+void *memcpy(void *dest, const void *src, size_t n) {
+    return memcpy_words(dest, src, n);
+}
+
+void *memmove(void *dest, const void *src, size_t n) {
+    return memmove_words(dest, src, n);
+}
+#endif
+
 int memcmp(const void *a, const void *b, size_t n) {
     const unsigned char *pa = a, *pb = b;
     while (n--) {
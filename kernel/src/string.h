@@ -25,6 +25,14 @@ void *memcpy(void *dest, const void *src, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
 int memcmp(const void *a, const void *b, size_t n);
 
+/* Portable word-at-a-time versions the above fall back to */
+void *memset_words(void *s, int c, size_t n);
+void *memcpy_words(void *dest, const void *src, size_t n);
+void *memmove_words(void *dest, const void *src, size_t n);
+
+/* Pick the fastest memory functions for this CPU; call early at boot */
+void string_init(void);
+
 /* ----------------- itoa / number helpers ----------------- */
 void itoa(int value, char *str, int base);
 void utoa(unsigned long long value, char *str, int base);
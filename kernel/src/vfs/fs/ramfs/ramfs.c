@@ -1,6 +1,7 @@
 #include "ramfs.h"
 #include "kprint.h"
 #include "heap/kheap.h"
+#include "heap/slab.h"
 #include "string.h"
 #include "global.h"
 #include "vfs/vfs.h"
@@ -35,6 +36,28 @@ static ramfs_file_t ramfs_root_file = {
 
 static vfs_ops_t ramfs_ops;
 
+// Files and nodes have their own caches; nodes come out pre-constructed
+static kmem_cache_t* ramfs_file_cache;
+static kmem_cache_t* ramfs_node_cache;
+
+static void ramfs_node_ctor(void* obj) {
+    vfs_node_t* node = (vfs_node_t*)obj;
+    memset(node, 0, sizeof(vfs_node_t));
+    node->permissions = VFS_READ | VFS_WRITE;
+    node->ops = &ramfs_ops;
+}
+
+static void ramfs_init(void) {
+    if (ramfs_node_cache) return;
+    ramfs_file_cache = kmem_cache_create("ramfs_file", sizeof(ramfs_file_t), 0, NULL);
+    if (!ramfs_file_cache) return;
+    ramfs_node_cache = kmem_cache_create("ramfs_node", sizeof(vfs_node_t), 0, ramfs_node_ctor);
+    if (!ramfs_node_cache) {
+        kmem_cache_destroy(ramfs_file_cache);
+        ramfs_file_cache = NULL;
+    }
+}
+
 static vfs_node_t ramfs_root_node = {
     .name = "/",
     .type = VFS_NODE_DIR,
@@ -49,15 +72,30 @@ static vfs_node_t* ramfs_mount(void* data) {
     (void)data;
     if (debug && VLEVEL >= 2) 
         kprint(LOG_DEBUG, "ramfs: mount()\n");
+    if (!ramfs_file_cache || !ramfs_node_cache) return NULL;
     return &ramfs_root_node;
 }
 
 filesystem_t ramfs_fs = {
     .name = "ramfs",
-    .init = NULL,
+    .init = ramfs_init,
     .mount = ramfs_mount
 };
 
+// Wrap a ramfs file in a fresh VFS node
+static vfs_node_t* ramfs_new_node(ramfs_file_t* file, vfs_node_t* parent_node) {
+    vfs_node_t* node = kmem_cache_alloc(ramfs_node_cache);
+    if (!node) return NULL;
+
+    strncpy(node->name, file->name, sizeof(node->name));
+    node->name[sizeof(node->name) - 1] = '\0';
+    node->type = file->is_dir ? VFS_NODE_DIR : VFS_NODE_FILE;
+    node->size = file->size;
+    node->private_data = file;
+    node->parent = parent_node;
+    return node;
+}
+
 // Core VFS ops
 static ssize_t ramfs_read(vfs_node_t* node, size_t offset, size_t size, void* buffer) {
     ramfs_file_t* file = (ramfs_file_t*)node->private_data;
@@ -82,11 +120,8 @@ static ssize_t ramfs_write(vfs_node_t* node, size_t offset, size_t size, const v
     size_t end = offset + size;
 
     if (end > file->size) {
-        uint8_t* new_data = kmalloc(end);
-        if (file->data) {
-            memcpy(new_data, file->data, file->size);
-            kfree(file->data);
-        }
+        uint8_t* new_data = krealloc(file->data, end);
+        if (!new_data) return -1;
         if (offset > file->size) {
             memset(new_data + file->size, 0, offset - file->size);
         }
@@ -111,18 +146,8 @@ static int ramfs_readdir(vfs_node_t* node, size_t index, vfs_dirent_t* dirent) {
             strncpy(dirent->name, child->name, sizeof(dirent->name));
             dirent->name[sizeof(dirent->name) - 1] = '\0';
 
-            vfs_node_t* child_node = kmalloc(sizeof(vfs_node_t));
-            strncpy(child_node->name, child->name, sizeof(child_node->name));
-            child_node->name[sizeof(child_node->name) - 1] = '\0';
-            child_node->type = child->is_dir ? VFS_NODE_DIR : VFS_NODE_FILE;
-            child_node->permissions = VFS_READ | VFS_WRITE;
-            child_node->size = child->size;
-            child_node->private_data = child;
-            child_node->ops = &ramfs_ops;
-            child_node->parent = node;
-
-            dirent->node = child_node;
-            return 0;
+            dirent->node = ramfs_new_node(child, node);
+            return dirent->node ? 0 : -1;
         }
     }
 
@@ -139,16 +164,7 @@ static vfs_node_t* ramfs_finddir(vfs_node_t* node, const char* name) {
     ramfs_file_t* child = dir->children;
     while (child) {
         if (strcmp(child->name, name) == 0) {
-            vfs_node_t* child_node = kmalloc(sizeof(vfs_node_t));
-            strncpy(child_node->name, child->name, sizeof(child_node->name));
-            child_node->name[sizeof(child_node->name) - 1] = '\0';
-            child_node->type = child->is_dir ? VFS_NODE_DIR : VFS_NODE_FILE;
-            child_node->permissions = VFS_READ | VFS_WRITE;
-            child_node->size = child->size;
-            child_node->private_data = child;
-            child_node->ops = &ramfs_ops;
-            child_node->parent = node;
-            return child_node;
+            return ramfs_new_node(child, node);
         }
         child = child->next;
     }
@@ -163,12 +179,15 @@ static vfs_node_t* ramfs_create_node(vfs_node_t* parent_node, const char* name,
 
     if (!parent || !parent->is_dir) return NULL;
 
-    ramfs_file_t* file = kmalloc(sizeof(ramfs_file_t));
-    memset(file, 0, sizeof(ramfs_file_t));
+    ramfs_file_t* file = kmem_cache_alloc(ramfs_file_cache);
+    if (!file) return NULL;
     strncpy(file->name, name, sizeof(file->name));
     file->name[sizeof(file->name) - 1] = '\0';
     file->is_dir = is_dir;
+    file->data = NULL;
+    file->size = 0;
     file->parent = parent;
+    file->children = NULL;
 
     if (!is_dir && content && size > 0) {
         file->data = kmalloc(size);
@@ -179,17 +198,7 @@ static vfs_node_t* ramfs_create_node(vfs_node_t* parent_node, const char* name,
     file->next = parent->children;
     parent->children = file;
 
-    vfs_node_t* node = kmalloc(sizeof(vfs_node_t));
-    strncpy(node->name, name, sizeof(node->name));
-    node->name[sizeof(node->name) - 1] = '\0';
-    node->type = is_dir ? VFS_NODE_DIR : VFS_NODE_FILE;
-    node->permissions = VFS_READ | VFS_WRITE;
-    node->size = file->size;
-    node->private_data = file;
-    node->ops = &ramfs_ops;
-    node->parent = parent_node;
-
-    return node;
+    return ramfs_new_node(file, parent_node);
 }
 
 // Register the ops table
@@ -2,6 +2,8 @@
 #include "fonts.h"
 #include "global.h"
 #include "heap/kheap.h"
+#include "mmu/vmm.h"
+#include "cpu/cpu.h"
 #include <flanterm_backends/fb.h>
 
 static void* current_font = 0;
@@ -46,3 +48,12 @@ void ft_set_font(void* font, int font_size_x, int font_size_y) {
         g_kheap_ready ? font_free  : NULL
     );
 }
+
+void fb_enable_wc(void) {
+    uintptr_t virt = (uintptr_t)g_fb->address;
+    size_t size = g_fb->pitch * g_fb->height;
+
+    // Lines cached under the old type must reach the framebuffer first
+    wbinvd();
+    vmm_map_range(virt, virt_to_phys((void *)virt), size, VMM_WRITE | VMM_WC | VMM_HUGE);
+}
@@ -2,3 +2,6 @@
 
 void ft_init(void* font, int font_size_x, int font_size_y, int font_scale_x, int font_scale_y);
 void ft_set_font(void* font, int font_size_x, int font_size_y);
+
+// Remap the framebuffer write-combining; call once the VMM is up
+void fb_enable_wc(void);